@@ -0,0 +1,719 @@
+/*
+ * spibench - throughput and latency sweep for spiderdev.lib
+ *
+ * Runs spi_write() and spi_read() over a range of lengths at each SPI speed,
+ * spi_write_long() and spi_read_long() past the 32767 bytes those take,
+ * and writes one CSV row per (speed, op, length). Times come from the
+ * EClock, register reads per byte from the library statistics and, on
+ * host builds, from the simulated board.
+ *
+ * spibench [CSV=<file>] [MAXLEN=<n>] [CONTROLLER=<0|1>] [ALL] [SELECT] [VERIFY]
+ *
+ * Lengths go up to 65536 unless MAXLEN raises it, to 1048576 at most.
+ * ALL sweeps every speed encoding instead of the default set. Chip select
+ * stays high unless SELECT is given so nothing attached sees the traffic.
+ *
+ * VERIFY checks the data as well, before timing each speed. It needs MISO
+ * wired to MOSI, which is what the simulated board does by default.
+ * spi_transfer(), spi_transaction(), the reads, writes, their _long and
+ * stream forms are checked at every length, and so is switching between
+ * the two controllers of the board. On the host it also checks pin
+ * events and compares every byte clocked out with the data written.
+ * Failures are listed and the exit code is 10.
+ *
+ * Built against a SPI_TRACE library, TRACE=<file> also dumps the last
+ * TRACE_RING trace records for Host/spitrace.
+ */
+#include <exec/types.h>
+#include <devices/timer.h>
+#include <hardware/intbits.h>
+
+#include <proto/exec.h>
+#include <proto/timer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spi.h"
+#include "config_file.h"
+#include "timing.h"
+#include "trace.h"
+
+#ifdef SPI_HOST_SIM
+#include "spisim.h"
+#endif
+
+#define BENCH_DEFAULT_CSV		"spibench.csv"
+#define BENCH_SHORT_LENGTH		32767	// most spi_read/spi_write take
+#define BENCH_DEFAULT_LENGTH	65536	// longest swept without MAXLEN=
+#define BENCH_MAX_LENGTH		1048576
+#define BENCH_RETRIES			2		// retries of a timed out call before giving up
+#define BENCH_TIME_BUDGET_MS	250		// aim for this much bus time per length
+#define BENCH_MAX_CALLS			256
+
+#define VERIFY_IDLE				0xFF	// what a loopback returns for the dummy bytes of a read
+#define VERIFY_STREAM_BUF		1000	// not a FIFO multiple, so chunks straddle ring wraps
+#define VERIFY_ECHO				16		// transfer after each check, catches bytes left in the RX ring
+
+#define DEFAULT_CLOCKPORT		0xD80001
+#define DEFAULT_INTERRUPT		6
+
+struct Device *TimerBase = NULL;
+
+static const ULONG lengths[] = {1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 63, 64, 127, 128, 255, 256, 257,
+								511, 512, 1023, 1024, 2048, 4096, 8192, 16384, 32767, 65535, 65536,
+								262144, 1048576};
+
+static const UBYTE default_speeds[] = {SPI_KHZ(40), SPI_KHZ(100), SPI_MHZ(1), SPI_MHZ(2), SPI_MHZ(4),
+									SPI_MHZ(8), SPI_MHZ(16), SPI_MHZ(24), SPI_MHZ(32)};
+
+struct BenchResult
+{
+	ULONG calls;
+	ULONG bytes;
+	ULONG ticks;			// EClock ticks for all calls
+	ULONG min_ticks;
+	ULONG max_ticks;
+	ULONG polls;
+	ULONG reg_reads;		// host only, 0 on hardware
+	ULONG timeouts;
+	ULONG retries;
+};
+
+struct VerifyState
+{
+	struct SpiController *ctrl;
+	ULONG base;
+	const UBYTE *pattern;	// data sent, max_length bytes
+	UBYTE *check;			// data received
+	ULONG khz;
+	ULONG checks;
+	ULONG failed;
+};
+
+// Progress through a stream callback, bad is the first wrong byte or -1
+struct VerifyStream
+{
+	struct VerifyState *v;
+	ULONG pos;
+	LONG bad;
+};
+
+// a * b / c without 64 bit types, SAS/C has none
+static ULONG muldiv(ULONG a, ULONG b, ULONG c)
+{
+	ULONG hi = 0, lo = 0, q = 0, r = 0, t = 0;
+	int i = 0;
+
+	if (!c){
+		return 0xFFFFFFFF;
+	}
+
+	// 32x32 -> 64 from 16 bit halves
+	lo = (a & 0xFFFF) * (b & 0xFFFF);
+	t = (a >> 16) * (b & 0xFFFF) + (lo >> 16);
+	hi = t >> 16;
+	t = (t & 0xFFFF) + (a & 0xFFFF) * (b >> 16);
+	hi += (t >> 16) + (a >> 16) * (b >> 16);
+	lo = (t << 16) | (lo & 0xFFFF);
+
+	if (hi >= c){
+		return 0xFFFFFFFF;
+	}
+
+	// Restoring division of hi:lo by c
+	r = hi;
+	for (; i < 32; i++){
+		t = r & 0x80000000;
+		r = (r << 1) | (lo >> 31);
+		lo <<= 1;
+		q <<= 1;
+		if (t || r >= c){
+			r -= c;
+			q |= 1;
+		}
+	}
+	return q;
+}
+
+static ULONG eclock_diff(struct EClockVal *a, struct EClockVal *b)
+{
+	return b->ev_lo - a->ev_lo;
+}
+
+static ULONG speed_khz_of(UBYTE speed)
+{
+	return (speed & 0x80) ? (ULONG)(speed & 0x7F) * 1000 : speed;
+}
+
+static BOOL keyword(const char *arg, const char *key, const char **value)
+{
+	while (*key){
+		char c = *arg;
+
+		if (c >= 'a' && c <= 'z'){
+			c -= 'a' - 'A';
+		}
+		if (c != *key){
+			return FALSE;
+		}
+		arg++;
+		key++;
+	}
+	if (value){
+		*value = arg;
+	}else if (*arg){
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static ULONG reg_reads(ULONG base)
+{
+#ifdef SPI_HOST_SIM
+	struct SpiSimStats st;
+	ULONG total = 0;
+	int i = 0;
+
+	spisim_get_stats(base, &st);
+	for (; i < 16; i++){
+		total += st.reads[i];
+	}
+	return total;
+#else
+	return 0;
+#endif
+}
+
+static LONG run_call(struct SpiController *ctrl, BOOL write, UBYTE *buf, ULONG length, struct BenchResult *res)
+{
+	LONG ret = 0;
+	int attempt = 0;
+
+	for (; attempt <= BENCH_RETRIES; attempt++){
+		if (attempt){
+			res->retries++;
+		}
+		if (length > BENCH_SHORT_LENGTH){
+			ret = write ? spi_write_long(ctrl, buf, length) : spi_read_long(ctrl, buf, length);
+		}else{
+			ret = write ? spi_write(ctrl, buf, (short)length) : spi_read(ctrl, buf, (short)length);
+		}
+		if (ret != SPI_ERR_TIMEOUT){
+			break;
+		}
+		res->timeouts++;
+	}
+	return ret;
+}
+
+static void run_length(struct SpiController *ctrl, ULONG base, BOOL write, UBYTE speed, ULONG length, UBYTE *buf, struct BenchResult *res)
+{
+	struct EClockVal t0, t1;
+	ULONG budget = speed_khz_of(speed) * BENCH_TIME_BUDGET_MS / 8;	// bytes in the time budget
+	ULONG calls = budget / length, reads0 = 0, ticks = 0, i = 0;
+	struct SpiStats st0, st1;
+
+	if (calls < 1){
+		calls = 1;
+	}else if (calls > BENCH_MAX_CALLS){
+		calls = BENCH_MAX_CALLS;
+	}
+
+	memset(res, 0, sizeof(struct BenchResult));
+	res->min_ticks = 0xFFFFFFFF;
+
+	spi_get_stats(ctrl, &st0);
+	reads0 = reg_reads(base);
+
+	for (; i < calls; i++){
+		ReadEClock(&t0);
+		if (run_call(ctrl, write, buf, length, res) < 0){
+			ReadEClock(&t1);
+			break;
+		}
+		ReadEClock(&t1);
+
+		ticks = eclock_diff(&t0, &t1);
+		res->ticks += ticks;
+		res->bytes += length;
+		res->calls++;
+		if (ticks < res->min_ticks){
+			res->min_ticks = ticks;
+		}
+		if (ticks > res->max_ticks){
+			res->max_ticks = ticks;
+		}
+	}
+
+	spi_get_stats(ctrl, &st1);
+	res->polls = st1.polls - st0.polls;
+	res->reg_reads = reg_reads(base) - reads0;
+	if (!res->calls){
+		res->min_ticks = 0;
+	}
+}
+
+#ifdef SPI_HOST_SIM
+// Loopback device that also compares every byte clocked out with what was written
+struct VerifyTap
+{
+	const UBYTE *expect;	// NULL while not checking
+	ULONG pos;
+	ULONG length;
+	LONG bad;
+};
+
+static struct VerifyTap tap;
+
+static UBYTE tap_device(void *userdata, UBYTE mosi, UBYTE slave_select)
+{
+	struct VerifyTap *t = userdata;
+
+	if (t->expect){
+		if (t->bad < 0 && (t->pos >= t->length || mosi != t->expect[t->pos])){
+			t->bad = t->pos;
+		}
+		t->pos++;
+	}
+	return mosi;
+}
+#endif
+
+static void tap_start(const UBYTE *expect, ULONG length)
+{
+#ifdef SPI_HOST_SIM
+	tap.expect = expect;
+	tap.pos = 0;
+	tap.length = length;
+	tap.bad = -1;
+#endif
+}
+
+// First byte clocked out wrong or missing since tap_start(), -1 if all were right.
+// Always -1 on hardware, where only the loopback is checked.
+static LONG tap_end(void)
+{
+#ifdef SPI_HOST_SIM
+	tap.expect = NULL;
+	if (tap.bad < 0 && tap.pos != tap.length){
+		return tap.pos;
+	}
+	return tap.bad;
+#else
+	return -1;
+#endif
+}
+
+static LONG first_diff(const UBYTE *a, const UBYTE *b, ULONG length)
+{
+	ULONG i = 0;
+
+	for (; i < length; i++){
+		if (a[i] != b[i]){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static LONG first_not(const UBYTE *buf, UBYTE value, ULONG length)
+{
+	ULONG i = 0;
+
+	for (; i < length; i++){
+		if (buf[i] != value){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void verify_result(struct VerifyState *v, const char *op, ULONG length, LONG ret, LONG bad)
+{
+	v->checks++;
+	if (ret < 0){
+		printf("VERIFY %s of %lu at %lu kHz: error %ld\n", op, (unsigned long)length, (unsigned long)v->khz, (long)ret);
+	}else if (bad >= 0){
+		printf("VERIFY %s of %lu at %lu kHz: wrong from byte %ld\n", op, (unsigned long)length, (unsigned long)v->khz, (long)bad);
+	}else{
+		return;
+	}
+	v->failed++;
+}
+
+// A short transfer after a check must echo exactly, or the check left the FIFO out of step
+static LONG verify_echo(struct VerifyState *v, struct SpiController *ctrl)
+{
+	UBYTE rx[VERIFY_ECHO];
+	LONG ret = spi_transfer(ctrl, v->pattern + 1, rx, VERIFY_ECHO);
+
+	if (ret < 0){
+		return 0;
+	}
+	return first_diff(v->pattern + 1, rx, VERIFY_ECHO);
+}
+
+static BOOL verify_consume(struct SpiController *ctrl, unsigned char *buf, ULONG length, APTR userdata)
+{
+	struct VerifyStream *vs = userdata;
+	LONG bad = first_not(buf, VERIFY_IDLE, length);
+
+	if (bad >= 0 && vs->bad < 0){
+		vs->bad = vs->pos + bad;
+	}
+	vs->pos += length;
+	return TRUE;
+}
+
+static BOOL verify_produce(struct SpiController *ctrl, unsigned char *buf, ULONG length, APTR userdata)
+{
+	struct VerifyStream *vs = userdata;
+
+	memcpy(buf, vs->v->pattern + vs->pos, length);
+	vs->pos += length;
+	return TRUE;
+}
+
+// Write, duplex, read and dummy segments, a quarter, half and the rest of length
+static void verify_transaction(struct VerifyState *v, ULONG length)
+{
+	struct SpiSegment segs[4];
+	ULONG a = length / 4, b = length / 2, c = length - a - b;
+	LONG ret = 0, bad = -1;
+	int n = 0;
+
+	memset(segs, 0, sizeof(segs));
+	memset(v->check, 0, length);
+	if (a){
+		segs[n].type = SPI_SEG_WRITE;
+		segs[n].length = a;
+		segs[n++].tx = v->pattern;
+	}
+	if (b){
+		segs[n].type = SPI_SEG_DUPLEX;
+		segs[n].length = b;
+		segs[n].tx = v->pattern + a;
+		segs[n++].rx = v->check + a;
+	}
+	segs[n].type = SPI_SEG_READ;
+	segs[n].length = c;
+	segs[n++].rx = v->check + a + b;
+	segs[n].type = SPI_SEG_DUMMY;
+	segs[n++].length = 3;
+
+	if ((ret = spi_transaction(v->ctrl, segs, n)) >= 0){
+		if ((bad = first_diff(v->pattern + a, v->check + a, b)) >= 0){
+			bad += a;
+		}else if ((bad = first_not(v->check + a + b, VERIFY_IDLE, c)) >= 0){
+			bad += a + b;
+		}else{
+			bad = verify_echo(v, v->ctrl);
+		}
+	}
+	verify_result(v, "transaction", length, ret, bad);
+}
+
+// Every transfer form at one length, the controller is at the speed being checked
+static void verify_length(struct VerifyState *v, ULONG length)
+{
+	struct VerifyStream vs;
+	BOOL is_long = length > BENCH_SHORT_LENGTH;
+	LONG ret = 0, bad = -1;
+
+	if (!is_long){
+		memset(v->check, 0, length);
+		if ((ret = spi_transfer(v->ctrl, v->pattern, v->check, (short)length)) >= 0 &&
+			(bad = first_diff(v->pattern, v->check, length)) < 0){
+			bad = verify_echo(v, v->ctrl);
+		}
+		verify_result(v, "transfer", length, ret, bad);
+	}
+	if (length <= 0xFFFF){
+		verify_transaction(v, length);
+	}
+
+	memset(v->check, 0, length);
+	ret = is_long ? spi_read_long(v->ctrl, v->check, length) : spi_read(v->ctrl, v->check, (short)length);
+	if (ret >= 0 && (bad = first_not(v->check, VERIFY_IDLE, length)) < 0){
+		bad = verify_echo(v, v->ctrl);
+	}
+	verify_result(v, is_long ? "read_long" : "read", length, ret, bad);
+
+	tap_start(v->pattern, length);
+	ret = is_long ? spi_write_long(v->ctrl, v->pattern, length) : spi_write(v->ctrl, v->pattern, (short)length);
+	if ((bad = tap_end()) < 0 && ret >= 0){
+		bad = verify_echo(v, v->ctrl);
+	}
+	verify_result(v, is_long ? "write_long" : "write", length, ret, bad);
+
+	vs.v = v;
+	vs.pos = 0;
+	vs.bad = -1;
+	ret = spi_read_stream(v->ctrl, length, v->check, VERIFY_STREAM_BUF, verify_consume, &vs);
+	if ((bad = vs.bad) < 0 && ret >= 0){
+		bad = vs.pos != length ? vs.pos : verify_echo(v, v->ctrl);
+	}
+	verify_result(v, "read_stream", length, ret, bad);
+
+	vs.pos = 0;
+	tap_start(v->pattern, length);
+	ret = spi_write_stream(v->ctrl, length, v->check, VERIFY_STREAM_BUF, verify_produce, &vs);
+	if ((bad = tap_end()) < 0 && ret >= 0){
+		bad = vs.pos != length ? vs.pos : verify_echo(v, v->ctrl);
+	}
+	verify_result(v, "write_stream", length, ret, bad);
+}
+
+// Alternates transfers between the handle and one on the other controller, which runs
+// at another speed, so the shared speed and select registers change hands every time
+static void verify_handoff(struct VerifyState *v, struct SpiController *peer)
+{
+	LONG bad = -1;
+	int i = 0;
+
+	spi_set_speed(peer, SPI_KHZ(100));
+	for (; i < 8 && bad < 0; i++){
+		bad = verify_echo(v, (i & 1) ? peer : v->ctrl);
+	}
+	verify_result(v, "handoff", VERIFY_ECHO * i, 0, bad);
+}
+
+#ifdef SPI_HOST_SIM
+// An edge on PIN_INT must reach the handle as one event
+static void verify_events(struct VerifyState *v)
+{
+	struct SpiEvent events[SPI_EVENT_RING];
+	int n = 0;
+
+	spi_reset_interrupt(v->ctrl);
+	spisim_set_gpios(v->base, PIN_INT);
+	n = spi_get_events(v->ctrl, events, SPI_EVENT_RING);
+	spisim_set_gpios(v->base, 0);
+	spi_reset_interrupt(v->ctrl);
+	verify_result(v, "event", 1, 0, n == 1 && (events[0].pins & PIN_INT) && (events[0].gpios & PIN_INT) ? -1 : n);
+}
+#endif
+
+// Two decimal places from a ratio, printed as %lu.%02lu
+static void ratio100(ULONG num, ULONG den, unsigned long *whole, unsigned long *frac)
+{
+	ULONG r = den ? muldiv(num, 100, den) : 0;
+
+	*whole = r / 100;
+	*frac = r % 100;
+}
+
+// Printed values are unsigned long so %lu is right on the host build too
+static void print_row(FILE *csv, UBYTE speed, const char *op, ULONG length, struct BenchResult *res, ULONG eclock)
+{
+	unsigned long len = length, khz = speed_khz_of(speed), calls = res->calls, bytes = res->bytes;
+	unsigned long us = muldiv(res->ticks, 1000000, eclock);
+	unsigned long bps = muldiv(res->bytes, eclock, res->ticks);
+	unsigned long lat_min = muldiv(res->min_ticks, 1000000, eclock);
+	unsigned long lat_max = muldiv(res->max_ticks, 1000000, eclock);
+	unsigned long lat_avg = calls ? us / calls : 0;
+	unsigned long timeouts = res->timeouts, retries = res->retries;
+	unsigned long pw = 0, pf = 0, rw = 0, rf = 0;
+
+	ratio100(res->polls, res->bytes, &pw, &pf);
+	ratio100(res->reg_reads, res->bytes, &rw, &rf);
+
+	fprintf(csv, "%u,%lu,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu.%02lu,%lu.%02lu,%lu,%lu\n",
+			speed, khz, op, len, calls, bytes, us, bps, lat_min, lat_avg, lat_max, pw, pf, rw, rf, timeouts, retries);
+	printf("%-5lu %-5s %7lu %10lu %9lu %9lu %9lu %5lu.%02lu %5lu.%02lu %5lu\n",
+			khz, op, len, bps, lat_min, lat_avg, lat_max, pw, pf, rw, rf, timeouts);
+}
+
+int main(int argc, char **argv)
+{
+	struct ClockportConfig cfg = {DEFAULT_CLOCKPORT, DEFAULT_INTERRUPT};
+	struct SpiController *ctrl = NULL, *peer = NULL;
+	struct VerifyState verify;
+	struct IORequest *tmr = NULL;
+	struct BenchResult res;
+	struct SpiCaps caps;
+	struct EClockVal ev;
+	const char *csv_name = BENCH_DEFAULT_CSV, *trace_name = NULL, *value = NULL;
+	ULONG max_length = BENCH_DEFAULT_LENGTH, eclock = 0;
+	UBYTE controller = 0, speed = 0;
+	UBYTE speeds[254];
+	int nspeeds = 0, s = 0, l = 0, op = 0, i = 1, ret = 0;
+	BOOL all = FALSE, use_select = FALSE, use_verify = FALSE;
+	UBYTE *buf = NULL, *check = NULL;
+	FILE *csv = NULL;
+
+	for (; i < argc; i++){
+		if (keyword(argv[i], "CSV=", &value)){
+			csv_name = value;
+		}else if (keyword(argv[i], "MAXLEN=", &value)){
+			max_length = strtoul(value, NULL, 0);
+		}else if (keyword(argv[i], "CONTROLLER=", &value)){
+			controller = (UBYTE)strtoul(value, NULL, 0);
+		}else if (keyword(argv[i], "TRACE=", &value)){
+			trace_name = value;
+		}else if (keyword(argv[i], "ALL", NULL)){
+			all = TRUE;
+		}else if (keyword(argv[i], "SELECT", NULL)){
+			use_select = TRUE;
+		}else if (keyword(argv[i], "VERIFY", NULL)){
+			use_verify = TRUE;
+		}else{
+			printf("usage: %s [CSV=<file>] [MAXLEN=<n>] [CONTROLLER=<0|1>] [ALL] [SELECT] [VERIFY] [TRACE=<file>]\n", argv[0]);
+			return 5;
+		}
+	}
+	if (max_length < 1 || max_length > BENCH_MAX_LENGTH){
+		max_length = BENCH_MAX_LENGTH;
+	}
+
+	if (all){
+		for (i = 1; i < 128; i++){
+			speeds[nspeeds++] = SPI_KHZ(i);
+		}
+		for (i = 1; i < 128; i++){
+			speeds[nspeeds++] = SPI_MHZ(i);
+		}
+	}else{
+		for (; nspeeds < sizeof(default_speeds); nspeeds++){
+			speeds[nspeeds] = default_speeds[nspeeds];
+		}
+	}
+
+	read_and_parse_config_file(&cfg);
+
+#ifdef SPI_HOST_SIM
+	spisim_attach(cfg.clockport_address, 1, 1, 0, cfg.interrupt_number == 2 ? INTB_PORTS : (cfg.interrupt_number == 3 ? INTB_VERTB : INTB_EXTER));
+#endif
+
+	if (!(tmr = openTimer())){
+		printf("Cannot open timer.device\n");
+		return 20;
+	}
+	TimerBase = tmr->io_Device;
+	eclock = ReadEClock(&ev);
+
+	if (!(buf = AllocMem(max_length + 1, MEMF_PUBLIC))){
+		printf("Out of memory\n");
+		ret = 20;
+		goto done;
+	}
+	for (i = 0; i < max_length; i++){
+		buf[i] = (UBYTE)(i * 7);
+	}
+
+	if (!(ctrl = spi_initialize(&cfg, controller, -1))){
+		printf("No SPIder found at 0x%06lX\n", (unsigned long)cfg.clockport_address);
+		ret = 20;
+		goto done;
+	}
+
+	memset(&verify, 0, sizeof(verify));
+	if (use_verify){
+		if (!(check = AllocMem(max_length + 1, MEMF_PUBLIC)) || !(peer = spi_initialize(&cfg, controller ^ 1, -1))){
+			printf("Cannot set up VERIFY\n");
+			ret = 20;
+			goto done;
+		}
+		verify.ctrl = ctrl;
+		verify.base = cfg.clockport_address;
+		verify.pattern = buf;
+		verify.check = check;
+#ifdef SPI_HOST_SIM
+		spisim_set_device(cfg.clockport_address, tap_device, &tap);
+		verify_events(&verify);
+#endif
+	}
+
+	if (!(csv = fopen(csv_name, "w"))){
+		printf("Cannot open %s\n", csv_name);
+		ret = 20;
+		goto done;
+	}
+	fprintf(csv, "speed,khz,op,length,calls,bytes,us,bytes_per_sec,lat_min_us,lat_avg_us,lat_max_us,polls_per_byte,reg_reads_per_byte,timeouts,retries\n");
+	printf("%-5s %-5s %7s %10s %9s %9s %9s %8s %8s %5s\n", "khz", "op", "length", "bytes/s", "lat min", "lat avg", "lat max", "polls/B", "reads/B", "t/o");
+
+#ifdef SPI_TRACE
+	if (trace_name){
+		trace_start(tmr);
+	}
+#else
+	if (trace_name){
+		printf("Built without SPI_TRACE, %s will not be written\n", trace_name);
+	}
+#endif
+	if (use_select){
+		spi_select(ctrl);
+	}
+
+	spi_get_caps(ctrl, &caps);
+	for (s = 0; s < nspeeds; s++){
+		speed = speeds[s];
+		// spi_set_speed() would run it at a lower speed
+		if (!SPI_CAP_SPEED(&caps, speed)){
+			continue;
+		}
+		spi_set_speed(ctrl, speed);
+
+		if (use_verify){
+			verify.khz = speed_khz_of(speed);
+			for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]) && lengths[l] <= max_length; l++){
+				verify_length(&verify, lengths[l]);
+			}
+			verify_handoff(&verify, peer);
+			spi_set_speed(ctrl, speed);
+		}
+
+		for (op = 0; op < 2; op++){
+			for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]) && lengths[l] <= max_length; l++){
+				run_length(ctrl, cfg.clockport_address, op == 0, speed, lengths[l], buf, &res);
+
+				print_row(csv, speed, op == 0 ? "write" : "read", lengths[l], &res, eclock);
+
+				if (!res.calls){
+					printf("Stopping this sweep after %lu timeouts\n", (unsigned long)res.timeouts);
+					break;
+				}
+			}
+		}
+	}
+
+	if (use_select){
+		spi_deselect(ctrl);
+	}
+#ifdef SPI_TRACE
+	if (trace_name){
+		trace_stop();
+		if (trace_dump(trace_name) < 0){
+			printf("Cannot write %s\n", trace_name);
+		}
+	}
+#endif
+
+	if (use_verify){
+		printf("Verify: %lu checks, %lu failed\n", (unsigned long)verify.checks, (unsigned long)verify.failed);
+		if (verify.failed){
+			ret = 10;
+		}
+	}
+
+done:
+	if (csv){
+		fclose(csv);
+	}
+	if (peer){
+		spi_shutdown(peer);
+	}
+	if (ctrl){
+		spi_shutdown(ctrl);
+	}
+	if (check){
+		FreeMem(check, max_length + 1);
+	}
+	if (buf){
+		FreeMem(buf, max_length + 1);
+	}
+	timerCloseTimer(tmr);
+	return ret;
+}
@@ -0,0 +1,756 @@
+/*
+ * Minimal Exec, DOS and timer.device stand-ins for host builds of
+ * spiderdev.lib. Single threaded: there is one task, Forbid/Disable are
+ * no-ops and interrupt servers only run from host_raise_interrupt().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HOST_STUBS
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <proto/timer.h>
+#include <clib/alib_protos.h>
+
+#include "spisim.h"
+
+#define INT_VECTORS		16
+#define MAX_VARS		32
+#define MAX_FILES		16
+#define MAX_TIMERS		16
+
+static struct ExecBase host_exec;
+struct ExecBase *SysBase = &host_exec;
+
+static struct Task main_task;
+static struct List int_servers[INT_VECTORS];
+static struct Interrupt *int_vectors[INT_VECTORS];
+static BOOL lists_ready;
+
+// TR_ADDREQUESTs sent and not yet due in simulated time
+static struct
+{
+	struct IORequest *io;
+	uint64_t due;
+} timers[MAX_TIMERS];
+static int timer_count;
+
+static struct
+{
+	char name[64];
+	char *value;
+	LONG size;
+} vars[MAX_VARS];
+
+static void host_init(void)
+{
+	int i = 0;
+
+	if (lists_ready){
+		return;
+	}
+	lists_ready = TRUE;
+	for (; i < INT_VECTORS; i++){
+		NewList(&int_servers[i]);
+	}
+	NewList(&host_exec.SemaphoreList);
+	host_exec.VBlankFrequency = 50;
+	host_exec.PowerSupplyFrequency = 50;
+	host_exec.ex_EClockFrequency = SPISIM_ECLOCK_FREQ;
+	main_task.tc_Node.ln_Name = "host";
+	main_task.tc_Node.ln_Type = NT_PROCESS;		// DOS may be called
+	main_task.tc_SigAlloc = 0xFFFF;		// system signals
+}
+
+// Lists
+
+void NewList(struct List *list)
+{
+	list->lh_Head = (struct Node *)&list->lh_Tail;
+	list->lh_Tail = NULL;
+	list->lh_TailPred = (struct Node *)&list->lh_Head;
+}
+
+void AddHead(struct List *list, struct Node *node)
+{
+	node->ln_Succ = list->lh_Head;
+	node->ln_Pred = (struct Node *)&list->lh_Head;
+	list->lh_Head->ln_Pred = node;
+	list->lh_Head = node;
+}
+
+void AddTail(struct List *list, struct Node *node)
+{
+	node->ln_Succ = (struct Node *)&list->lh_Tail;
+	node->ln_Pred = list->lh_TailPred;
+	list->lh_TailPred->ln_Succ = node;
+	list->lh_TailPred = node;
+}
+
+void Remove(struct Node *node)
+{
+	node->ln_Pred->ln_Succ = node->ln_Succ;
+	node->ln_Succ->ln_Pred = node->ln_Pred;
+}
+
+struct Node *RemHead(struct List *list)
+{
+	struct Node *node = list->lh_Head;
+
+	if (!node->ln_Succ){
+		return NULL;
+	}
+	Remove(node);
+	return node;
+}
+
+void Enqueue(struct List *list, struct Node *node)
+{
+	struct Node *n = list->lh_Head;
+
+	while (n->ln_Succ && n->ln_Pri >= node->ln_Pri){
+		n = n->ln_Succ;
+	}
+	node->ln_Succ = n;
+	node->ln_Pred = n->ln_Pred;
+	n->ln_Pred->ln_Succ = node;
+	n->ln_Pred = node;
+}
+
+// Tasks and signals
+
+struct Task *FindTask(const char *name)
+{
+	host_init();
+	return name ? NULL : &main_task;
+}
+
+void Signal(struct Task *task, ULONG sigs)
+{
+	task->tc_SigRecvd |= sigs;
+}
+
+static void timers_run(void);
+static BOOL timers_next(uint64_t *due);
+
+// Nothing else can run, so waiting on a signal nobody has sent moves
+// simulated time on to the next timer request, or by a millisecond, and
+// may return empty handed
+ULONG Wait(ULONG sigs)
+{
+	struct Task *task = FindTask(NULL);
+	ULONG got = 0;
+	uint64_t due = 0;
+
+	timers_run();
+	if (!(task->tc_SigRecvd & sigs)){
+		if (timers_next(&due)){
+			spisim_advance_ns(due - spisim_now_ns());
+			timers_run();
+		}else{
+			spisim_advance_ns(1000000);
+		}
+	}
+	got = task->tc_SigRecvd & sigs;
+	task->tc_SigRecvd &= ~got;
+	return got;
+}
+
+ULONG SetSignal(ULONG newsigs, ULONG mask)
+{
+	struct Task *task = FindTask(NULL);
+	ULONG old = task->tc_SigRecvd;
+
+	task->tc_SigRecvd = (old & ~mask) | (newsigs & mask);
+	return old;
+}
+
+BYTE AllocSignal(LONG sig)
+{
+	struct Task *task = FindTask(NULL);
+
+	if (sig < 0){
+		for (sig = 31; sig >= 16; sig--){
+			if (!(task->tc_SigAlloc & (1UL << sig))){
+				break;
+			}
+		}
+		if (sig < 16){
+			return -1;
+		}
+	}else if (task->tc_SigAlloc & (1UL << sig)){
+		return -1;
+	}
+	task->tc_SigAlloc |= 1UL << sig;
+	task->tc_SigRecvd &= ~(1UL << sig);
+	return (BYTE)sig;
+}
+
+void FreeSignal(LONG sig)
+{
+	if (sig >= 0){
+		FindTask(NULL)->tc_SigAlloc &= ~(1UL << sig);
+	}
+}
+
+BYTE SetTaskPri(struct Task *task, LONG pri)
+{
+	BYTE old = task->tc_Node.ln_Pri;
+
+	task->tc_Node.ln_Pri = (BYTE)pri;
+	return old;
+}
+
+// There is no scheduler to run a second task on
+struct Task *CreateTask(const char *name, LONG pri, APTR initpc, ULONG stacksize)
+{
+	return NULL;
+}
+
+void DeleteTask(struct Task *task)
+{
+}
+
+void Forbid(void)
+{
+}
+
+void Permit(void)
+{
+}
+
+void Disable(void)
+{
+}
+
+void Enable(void)
+{
+}
+
+// Interrupts
+
+void AddIntServer(LONG num, struct Interrupt *irq)
+{
+	host_init();
+	Enqueue(&int_servers[num], &irq->is_Node);
+}
+
+void RemIntServer(LONG num, struct Interrupt *irq)
+{
+	Remove(&irq->is_Node);
+}
+
+struct Interrupt *SetIntVector(LONG num, struct Interrupt *irq)
+{
+	struct Interrupt *old = int_vectors[num];
+
+	int_vectors[num] = irq;
+	return old;
+}
+
+void Cause(struct Interrupt *irq)
+{
+	((void (*)(APTR, APTR))irq->is_Code)(irq->is_Data, (APTR)irq->is_Code);
+}
+
+// Servers run in priority order until one returns non-zero (Z clear)
+void host_raise_interrupt(LONG int_num)
+{
+	struct Node *n = NULL, *next = NULL;
+	struct Interrupt *irq = NULL;
+
+	host_init();
+	if (int_vectors[int_num]){
+		Cause(int_vectors[int_num]);
+	}
+	for (n = int_servers[int_num].lh_Head; (next = n->ln_Succ); n = next){
+		irq = (struct Interrupt *)n;
+		if (((ULONG (*)(APTR, APTR))irq->is_Code)(irq->is_Data, (APTR)irq->is_Code)){
+			break;
+		}
+	}
+}
+
+// Memory
+
+APTR AllocMem(ULONG size, ULONG flags)
+{
+	return (flags & MEMF_CLEAR) ? calloc(1, size) : malloc(size);
+}
+
+void FreeMem(APTR mem, ULONG size)
+{
+	free(mem);
+}
+
+APTR AllocVec(ULONG size, ULONG flags)
+{
+	return AllocMem(size, flags);
+}
+
+void FreeVec(APTR mem)
+{
+	free(mem);
+}
+
+// Messages
+
+struct MsgPort *CreateMsgPort(void)
+{
+	struct MsgPort *port = AllocMem(sizeof(struct MsgPort), MEMF_CLEAR);
+	BYTE sig = 0;
+
+	if (port){
+		if ((sig = AllocSignal(-1)) < 0){
+			FreeMem(port, sizeof(struct MsgPort));
+			return NULL;
+		}
+		port->mp_Node.ln_Type = NT_MSGPORT;
+		port->mp_SigBit = sig;
+		port->mp_SigTask = FindTask(NULL);
+		NewList(&port->mp_MsgList);
+	}
+	return port;
+}
+
+void DeleteMsgPort(struct MsgPort *port)
+{
+	if (port){
+		FreeSignal(port->mp_SigBit);
+		FreeMem(port, sizeof(struct MsgPort));
+	}
+}
+
+void PutMsg(struct MsgPort *port, struct Message *msg)
+{
+	msg->mn_Node.ln_Type = NT_MESSAGE;
+	AddTail(&port->mp_MsgList, &msg->mn_Node);
+	if (port->mp_Flags == PA_SIGNAL && port->mp_SigTask){
+		Signal(port->mp_SigTask, 1UL << port->mp_SigBit);
+	}
+}
+
+struct Message *GetMsg(struct MsgPort *port)
+{
+	return (struct Message *)RemHead(&port->mp_MsgList);
+}
+
+void ReplyMsg(struct Message *msg)
+{
+	if (msg->mn_ReplyPort){
+		PutMsg(msg->mn_ReplyPort, msg);
+	}
+	msg->mn_Node.ln_Type = NT_REPLYMSG;
+}
+
+struct Message *WaitPort(struct MsgPort *port)
+{
+	while (IsListEmpty(&port->mp_MsgList)){
+		Wait(1UL << port->mp_SigBit);
+	}
+	return (struct Message *)port->mp_MsgList.lh_Head;
+}
+
+// Semaphores, uncontended with a single task
+
+void InitSemaphore(struct SignalSemaphore *sem)
+{
+	memset(sem, 0, sizeof(struct SignalSemaphore));
+	sem->ss_Link.ln_Type = NT_SIGNALSEM;
+	NewList((struct List *)&sem->ss_WaitQueue);
+}
+
+void ObtainSemaphore(struct SignalSemaphore *sem)
+{
+	sem->ss_Owner = FindTask(NULL);
+	sem->ss_NestCount++;
+}
+
+void ObtainSemaphoreShared(struct SignalSemaphore *sem)
+{
+	sem->ss_NestCount++;
+}
+
+void ReleaseSemaphore(struct SignalSemaphore *sem)
+{
+	if (--sem->ss_NestCount == 0){
+		sem->ss_Owner = NULL;
+	}
+}
+
+void AddSemaphore(struct SignalSemaphore *sem)
+{
+	host_init();
+	Enqueue(&host_exec.SemaphoreList, &sem->ss_Link);
+}
+
+struct SignalSemaphore *FindSemaphore(const char *name)
+{
+	struct Node *n = NULL;
+
+	host_init();
+	for (n = host_exec.SemaphoreList.lh_Head; n->ln_Succ; n = n->ln_Succ){
+		if (n->ln_Name && strcmp(n->ln_Name, name) == 0){
+			return (struct SignalSemaphore *)n;
+		}
+	}
+	return NULL;
+}
+
+// Libraries and devices. timer.device requests complete immediately.
+
+static struct Library host_library;
+static struct Device host_device;
+
+struct Library *OpenLibrary(const char *name, ULONG version)
+{
+	return &host_library;
+}
+
+void CloseLibrary(struct Library *lib)
+{
+}
+
+struct IORequest *CreateIORequest(struct MsgPort *port, ULONG size)
+{
+	struct IORequest *io = NULL;
+
+	if (port && (io = AllocMem(size, MEMF_CLEAR))){
+		io->io_Message.mn_ReplyPort = port;
+		io->io_Message.mn_Length = (UWORD)size;
+		io->io_Message.mn_Node.ln_Type = NT_REPLYMSG;
+	}
+	return io;
+}
+
+void DeleteIORequest(struct IORequest *io)
+{
+	if (io){
+		FreeMem(io, io->io_Message.mn_Length);
+	}
+}
+
+BYTE OpenDevice(const char *name, ULONG unit, struct IORequest *io, ULONG flags)
+{
+	io->io_Device = &host_device;
+	io->io_Error = 0;
+	return 0;
+}
+
+void CloseDevice(struct IORequest *io)
+{
+	io->io_Device = NULL;
+}
+
+static void complete_io(struct IORequest *io)
+{
+	struct timerequest *tr = (struct timerequest *)io;
+
+	if (io->io_Command == TR_ADDREQUEST){
+		spisim_advance_ns((uint64_t)tr->tr_time.tv_secs * 1000000000ULL + (uint64_t)tr->tr_time.tv_micro * 1000ULL);
+	}else if (io->io_Command == TR_GETSYSTIME){
+		GetSysTime(&tr->tr_time);
+	}
+	io->io_Error = 0;
+}
+
+BYTE DoIO(struct IORequest *io)
+{
+	complete_io(io);
+	io->io_Message.mn_Node.ln_Type = NT_REPLYMSG;
+	return io->io_Error;
+}
+
+static int timer_find(struct IORequest *io)
+{
+	int i = 0;
+
+	for (; i < timer_count; i++){
+		if (timers[i].io == io){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void timer_reply(int i, BYTE error)
+{
+	struct IORequest *io = timers[i].io;
+
+	timers[i] = timers[--timer_count];
+	io->io_Error = error;
+	ReplyMsg(&io->io_Message);
+}
+
+// Replies to the requests that are due
+static void timers_run(void)
+{
+	int i = 0;
+
+	while (i < timer_count){
+		if (timers[i].due <= spisim_now_ns()){
+			timer_reply(i, 0);
+		}else{
+			i++;
+		}
+	}
+}
+
+static BOOL timers_next(uint64_t *due)
+{
+	int i = 0;
+
+	for (; i < timer_count; i++){
+		if (!i || timers[i].due < *due){
+			*due = timers[i].due;
+		}
+	}
+	return timer_count > 0;
+}
+
+// Timer requests complete once simulated time reaches them, others at once
+void SendIO(struct IORequest *io)
+{
+	struct timerequest *tr = (struct timerequest *)io;
+
+	if (io->io_Command == TR_ADDREQUEST && timer_count < MAX_TIMERS){
+		io->io_Message.mn_Node.ln_Type = NT_MESSAGE;
+		timers[timer_count].io = io;
+		timers[timer_count].due = spisim_now_ns() +
+			(uint64_t)tr->tr_time.tv_secs * 1000000000ULL + (uint64_t)tr->tr_time.tv_micro * 1000ULL;
+		timer_count++;
+		return;
+	}
+	complete_io(io);
+	ReplyMsg(&io->io_Message);
+}
+
+struct IORequest *CheckIO(struct IORequest *io)
+{
+	timers_run();
+	return io->io_Message.mn_Node.ln_Type == NT_REPLYMSG ? io : NULL;
+}
+
+void AbortIO(struct IORequest *io)
+{
+	int i = timer_find(io);
+
+	if (i >= 0){
+		timer_reply(i, IOERR_ABORTED);
+	}
+}
+
+BYTE WaitIO(struct IORequest *io)
+{
+	int i = timer_find(io);
+
+	if (i >= 0){
+		spisim_advance_ns(timers[i].due - spisim_now_ns());
+		timer_reply(i, 0);
+	}
+	if (io->io_Message.mn_Node.ln_Type == NT_REPLYMSG && io->io_Message.mn_ReplyPort){
+		// Take it off the reply port if SendIO() queued it there
+		struct Node *n = io->io_Message.mn_ReplyPort->mp_MsgList.lh_Head;
+
+		for (; n->ln_Succ; n = n->ln_Succ){
+			if (n == &io->io_Message.mn_Node){
+				Remove(n);
+				break;
+			}
+		}
+	}
+	return io->io_Error;
+}
+
+// timer.device library calls
+
+void GetSysTime(struct timeval *tv)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	tv->tv_secs = (ULONG)now.tv_sec;
+	tv->tv_micro = (ULONG)(now.tv_nsec / 1000);
+}
+
+void AddTime(struct timeval *dst, struct timeval *src)
+{
+	dst->tv_secs += src->tv_secs;
+	dst->tv_micro += src->tv_micro;
+	if (dst->tv_micro >= 1000000){
+		dst->tv_micro -= 1000000;
+		dst->tv_secs++;
+	}
+}
+
+void SubTime(struct timeval *dst, struct timeval *src)
+{
+	if (dst->tv_micro < src->tv_micro){
+		dst->tv_micro += 1000000;
+		dst->tv_secs--;
+	}
+	dst->tv_micro -= src->tv_micro;
+	dst->tv_secs -= src->tv_secs;
+}
+
+LONG CmpTime(struct timeval *a, struct timeval *b)
+{
+	if (a->tv_secs != b->tv_secs){
+		return a->tv_secs > b->tv_secs ? -1 : 1;
+	}
+	if (a->tv_micro != b->tv_micro){
+		return a->tv_micro > b->tv_micro ? -1 : 1;
+	}
+	return 0;
+}
+
+// EClock follows simulated time so timings line up with the board model.
+// timer.device reads the CIA timer high and low bytes twice to get a
+// consistent pair, which is charged like any other CIA access.
+ULONG ReadEClock(struct EClockVal *ev)
+{
+	uint64_t ticks = 0;
+
+	spisim_advance_ns(4 * SPISIM_CIA_NS);
+	ticks = spisim_now_ns() * SPISIM_ECLOCK_FREQ / 1000000000ULL;
+
+	ev->ev_hi = (ULONG)(ticks >> 32);
+	ev->ev_lo = (ULONG)ticks;
+	return SPISIM_ECLOCK_FREQ;
+}
+
+// DOS. "VOL:path" maps to "VOL/path" below the current directory.
+
+static void host_path(const char *name, char *out, size_t size)
+{
+	size_t i = 0;
+
+	for (; name[i] && i + 1 < size; i++){
+		out[i] = name[i] == ':' ? '/' : name[i];
+	}
+	out[i] = 0;
+}
+
+static FILE *files[MAX_FILES];
+
+BPTR Open(const char *name, LONG mode)
+{
+	char path[256];
+	int i = 0;
+
+	for (; i < MAX_FILES && files[i]; i++){
+	}
+	if (i == MAX_FILES){
+		return 0;
+	}
+	host_path(name, path, sizeof(path));
+	files[i] = fopen(path, mode == MODE_NEWFILE ? "wb" : (mode == MODE_READWRITE ? "r+b" : "rb"));
+	if (!files[i] && mode == MODE_READWRITE){
+		files[i] = fopen(path, "w+b");
+	}
+	return files[i] ? i + 1 : 0;
+}
+
+static FILE *host_file(BPTR file)
+{
+	return (file > 0 && file <= MAX_FILES) ? files[file - 1] : NULL;
+}
+
+LONG Close(BPTR file)
+{
+	FILE *f = host_file(file);
+
+	if (!f){
+		return 0;
+	}
+	files[file - 1] = NULL;
+	return fclose(f) == 0;
+}
+
+LONG Read(BPTR file, APTR buf, LONG len)
+{
+	FILE *f = host_file(file);
+
+	return f ? (LONG)fread(buf, 1, len, f) : -1;
+}
+
+LONG Write(BPTR file, const void *buf, LONG len)
+{
+	FILE *f = host_file(file);
+
+	return f ? (LONG)fwrite(buf, 1, len, f) : -1;
+}
+
+// Returns the old position like dos.library
+LONG Seek(BPTR file, LONG pos, LONG mode)
+{
+	FILE *f = host_file(file);
+	LONG old = 0;
+
+	if (!f){
+		return -1;
+	}
+	old = ftell(f);
+	if (fseek(f, pos, mode == OFFSET_BEGINNING ? SEEK_SET : (mode == OFFSET_END ? SEEK_END : SEEK_CUR)) != 0){
+		return -1;
+	}
+	return old;
+}
+
+// Environment variables are kept in memory for the life of the process
+LONG GetVar(const char *name, char *buf, LONG size, ULONG flags)
+{
+	int i = 0;
+	LONG len = 0;
+
+	for (; i < MAX_VARS; i++){
+		if (vars[i].value && strcmp(vars[i].name, name) == 0){
+			len = vars[i].size < size ? vars[i].size : size;
+			memcpy(buf, vars[i].value, len);
+			if (!(flags & GVF_BINARY_VAR) && len < size){
+				buf[len] = 0;
+			}
+			return len;
+		}
+	}
+	return -1;
+}
+
+BOOL SetVar(const char *name, const char *buf, LONG size, ULONG flags)
+{
+	int i = 0, slot = -1;
+
+	if (size < 0){
+		size = (LONG)strlen(buf);
+	}
+	for (; i < MAX_VARS; i++){
+		if (vars[i].value && strcmp(vars[i].name, name) == 0){
+			slot = i;
+			break;
+		}
+		if (!vars[i].value && slot < 0){
+			slot = i;
+		}
+	}
+	if (slot < 0){
+		return FALSE;
+	}
+	free(vars[slot].value);
+	vars[slot].value = NULL;
+	if (buf){
+		if (!(vars[slot].value = malloc(size ? size : 1))){
+			return FALSE;
+		}
+		memcpy(vars[slot].value, buf, size);
+		vars[slot].size = size;
+		strncpy(vars[slot].name, name, sizeof(vars[slot].name) - 1);
+	}
+	return TRUE;
+}
+
+void Delay(LONG ticks)
+{
+	spisim_advance_ns((uint64_t)ticks * 20000000ULL);
+}
@@ -0,0 +1,10 @@
+#ifndef CLIB_ALIB_PROTOS_H
+#define CLIB_ALIB_PROTOS_H
+
+#include <exec/exec.h>
+
+void NewList(struct List *list);
+struct Task *CreateTask(const char *name, LONG pri, APTR initpc, ULONG stacksize);
+void DeleteTask(struct Task *task);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef DEVICES_TIMER_H
+#define DEVICES_TIMER_H
+
+#include <exec/io.h>
+
+// Keep the host's own struct timeval out of the way of the Amiga one
+#include <sys/time.h>
+#define timeval amiga_timeval
+
+#define UNIT_MICROHZ    0
+#define UNIT_VBLANK     1
+#define UNIT_ECLOCK     2
+#define UNIT_WAITUNTIL  3
+#define UNIT_WAITECLOCK 4
+
+#define TIMERNAME       "timer.device"
+
+#define TR_ADDREQUEST   (CMD_WRITE + 6)
+#define TR_GETSYSTIME   (CMD_WRITE + 7)
+#define TR_SETSYSTIME   (CMD_WRITE + 8)
+
+struct timeval
+{
+    ULONG tv_secs;
+    ULONG tv_micro;
+};
+
+struct EClockVal
+{
+    ULONG ev_hi;
+    ULONG ev_lo;
+};
+
+struct timerequest
+{
+    struct IORequest tr_node;
+    struct timeval tr_time;
+};
+
+#endif
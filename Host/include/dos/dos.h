@@ -0,0 +1,27 @@
+#ifndef DOS_DOS_H
+#define DOS_DOS_H
+
+#include <exec/types.h>
+#include <exec/libraries.h>
+
+#define DOSNAME             "dos.library"
+
+#define SIGBREAKF_CTRL_C    (1L << 12)
+#define SIGBREAKF_CTRL_D    (1L << 13)
+#define SIGBREAKF_CTRL_E    (1L << 14)
+#define SIGBREAKF_CTRL_F    (1L << 15)
+
+#define MODE_OLDFILE        1005
+#define MODE_NEWFILE        1006
+#define MODE_READWRITE      1004
+
+#define OFFSET_BEGINNING    -1
+#define OFFSET_CURRENT      0
+#define OFFSET_END          1
+
+struct DosLibrary
+{
+    struct Library dl_lib;
+};
+
+#endif
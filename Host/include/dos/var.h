@@ -0,0 +1,11 @@
+#ifndef DOS_VAR_H
+#define DOS_VAR_H
+
+#define LV_VAR              0
+#define GVF_GLOBAL_ONLY     (1L << 8)
+#define GVF_LOCAL_ONLY      (1L << 9)
+#define GVF_BINARY_VAR      (1L << 10)
+#define GVF_DONT_NULL_TERM  (1L << 11)
+#define GVF_SAVE_VAR        (1L << 12)
+
+#endif
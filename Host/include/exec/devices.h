@@ -0,0 +1,16 @@
+#ifndef EXEC_DEVICES_H
+#define EXEC_DEVICES_H
+
+#include <exec/libraries.h>
+
+struct Device
+{
+    struct Library dd_Library;
+};
+
+struct Unit
+{
+    struct MsgPort *unit_MsgPort;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef EXEC_EXECBASE_H
+#define EXEC_EXECBASE_H
+
+#include <exec/lists.h>
+#include <exec/libraries.h>
+
+struct ExecBase
+{
+    struct Library LibNode;
+    UWORD AttnFlags;
+    UBYTE VBlankFrequency;
+    UBYTE PowerSupplyFrequency;
+    struct List SemaphoreList;
+    ULONG ex_EClockFrequency;
+};
+
+#define AFB_68010   0
+#define AFB_68020   1
+#define AFB_68030   2
+#define AFB_68040   3
+#define AFB_68881   4
+#define AFB_68882   5
+#define AFB_FPU40   6
+#define AFB_68060   7
+
+#define AFF_68010   (1L << 0)
+#define AFF_68020   (1L << 1)
+#define AFF_68030   (1L << 2)
+#define AFF_68040   (1L << 3)
+#define AFF_68881   (1L << 4)
+#define AFF_68882   (1L << 5)
+#define AFF_FPU40   (1L << 6)
+#define AFF_68060   (1L << 7)
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef EXEC_IO_H
+#define EXEC_IO_H
+
+#include <exec/ports.h>
+#include <exec/devices.h>
+
+struct IORequest
+{
+    struct Message io_Message;
+    struct Device *io_Device;
+    struct Unit *io_Unit;
+    UWORD io_Command;
+    UBYTE io_Flags;
+    BYTE io_Error;
+};
+
+#define CMD_INVALID 0
+#define CMD_RESET   1
+#define CMD_READ    2
+#define CMD_WRITE   3
+
+#define IOF_QUICK   1
+
+#define IOERR_ABORTED   (-2)
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef EXEC_LIBRARIES_H
+#define EXEC_LIBRARIES_H
+
+#include <exec/nodes.h>
+
+struct Library
+{
+    struct Node lib_Node;
+    UWORD lib_Version;
+    UWORD lib_Revision;
+};
+
+#endif
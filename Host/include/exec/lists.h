@@ -0,0 +1,24 @@
+#ifndef EXEC_LISTS_H
+#define EXEC_LISTS_H
+
+#include <exec/nodes.h>
+
+struct List
+{
+    struct Node *lh_Head;
+    struct Node *lh_Tail;
+    struct Node *lh_TailPred;
+    UBYTE lh_Type;
+    UBYTE l_pad;
+};
+
+struct MinList
+{
+    struct MinNode *mlh_Head;
+    struct MinNode *mlh_Tail;
+    struct MinNode *mlh_TailPred;
+};
+
+#define IsListEmpty(x)  (((struct List *)(x))->lh_TailPred == (struct Node *)(x))
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef EXEC_SEMAPHORES_H
+#define EXEC_SEMAPHORES_H
+
+#include <exec/ports.h>
+
+struct SignalSemaphore
+{
+    struct Node ss_Link;
+    WORD ss_NestCount;
+    struct MinList ss_WaitQueue;
+    struct Task *ss_Owner;
+    WORD ss_QueueCount;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef EXEC_TASKS_H
+#define EXEC_TASKS_H
+
+#include <exec/lists.h>
+
+struct Task
+{
+    struct Node tc_Node;
+    ULONG tc_SigAlloc;
+    ULONG tc_SigWait;
+    ULONG tc_SigRecvd;
+    APTR tc_UserData;
+};
+
+#define SIGB_SINGLE     4
+#define SIGF_SINGLE     (1L << 4)
+
+
+#endif
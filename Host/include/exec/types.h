@@ -0,0 +1,22 @@
+#ifndef EXEC_TYPES_H
+#define EXEC_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef void           *APTR;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef int16_t         WORD;
+typedef uint16_t        UWORD;
+typedef signed char     BYTE;
+typedef unsigned char   UBYTE;
+typedef int16_t         BOOL;
+typedef char           *STRPTR;
+typedef int32_t         BPTR;
+typedef void            VOID;
+
+#define TRUE    1
+#define FALSE   0
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef PROTO_DOS_H
+#define PROTO_DOS_H
+
+#include <dos/dos.h>
+#include <dos/var.h>
+
+BPTR Open(const char *name, LONG mode);
+LONG Close(BPTR file);
+LONG Read(BPTR file, APTR buf, LONG len);
+LONG Write(BPTR file, const void *buf, LONG len);
+LONG Seek(BPTR file, LONG pos, LONG mode);
+LONG GetVar(const char *name, char *buf, LONG size, ULONG flags);
+BOOL SetVar(const char *name, const char *buf, LONG size, ULONG flags);
+void Delay(LONG ticks);
+
+#endif
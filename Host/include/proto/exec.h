@@ -0,0 +1,56 @@
+#ifndef PROTO_EXEC_H
+#define PROTO_EXEC_H
+
+#include <exec/exec.h>
+
+extern struct ExecBase *SysBase;
+
+struct Task *FindTask(const char *name);
+void Signal(struct Task *task, ULONG sigs);
+ULONG Wait(ULONG sigs);
+ULONG SetSignal(ULONG newsigs, ULONG mask);
+BYTE AllocSignal(LONG sig);
+void FreeSignal(LONG sig);
+void AddIntServer(LONG num, struct Interrupt *irq);
+void RemIntServer(LONG num, struct Interrupt *irq);
+struct Interrupt *SetIntVector(LONG num, struct Interrupt *irq);
+void Cause(struct Interrupt *irq);
+void Forbid(void);
+void Permit(void);
+void Disable(void);
+void Enable(void);
+APTR AllocMem(ULONG size, ULONG flags);
+void FreeMem(APTR mem, ULONG size);
+APTR AllocVec(ULONG size, ULONG flags);
+void FreeVec(APTR mem);
+struct MsgPort *CreateMsgPort(void);
+void DeleteMsgPort(struct MsgPort *port);
+struct IORequest *CreateIORequest(struct MsgPort *port, ULONG size);
+void DeleteIORequest(struct IORequest *io);
+BYTE OpenDevice(const char *name, ULONG unit, struct IORequest *io, ULONG flags);
+void CloseDevice(struct IORequest *io);
+BYTE DoIO(struct IORequest *io);
+void SendIO(struct IORequest *io);
+struct IORequest *CheckIO(struct IORequest *io);
+void AbortIO(struct IORequest *io);
+BYTE WaitIO(struct IORequest *io);
+struct Message *GetMsg(struct MsgPort *port);
+void PutMsg(struct MsgPort *port, struct Message *msg);
+void ReplyMsg(struct Message *msg);
+struct Message *WaitPort(struct MsgPort *port);
+struct Library *OpenLibrary(const char *name, ULONG version);
+void CloseLibrary(struct Library *lib);
+void AddHead(struct List *list, struct Node *node);
+void AddTail(struct List *list, struct Node *node);
+void Remove(struct Node *node);
+struct Node *RemHead(struct List *list);
+void Enqueue(struct List *list, struct Node *node);
+void InitSemaphore(struct SignalSemaphore *sem);
+void ObtainSemaphore(struct SignalSemaphore *sem);
+void ObtainSemaphoreShared(struct SignalSemaphore *sem);
+void ReleaseSemaphore(struct SignalSemaphore *sem);
+void AddSemaphore(struct SignalSemaphore *sem);
+struct SignalSemaphore *FindSemaphore(const char *name);
+BYTE SetTaskPri(struct Task *task, LONG pri);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PROTO_TIMER_H
+#define PROTO_TIMER_H
+
+#include <devices/timer.h>
+
+void GetSysTime(struct timeval *tv);
+void SubTime(struct timeval *dst, struct timeval *src);
+void AddTime(struct timeval *dst, struct timeval *src);
+LONG CmpTime(struct timeval *a, struct timeval *b);
+ULONG ReadEClock(struct EClockVal *ev);
+
+/* Like the SAS/C pragmas, calls go through the TimerBase in scope. */
+#ifndef HOST_STUBS
+#define GetSysTime(tv)		((void)TimerBase, GetSysTime(tv))
+#define SubTime(dst, src)	((void)TimerBase, SubTime(dst, src))
+#define AddTime(dst, src)	((void)TimerBase, AddTime(dst, src))
+#define CmpTime(a, b)		((void)TimerBase, CmpTime(a, b))
+#define ReadEClock(ev)		((void)TimerBase, ReadEClock(ev))
+#endif
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Host build compatibility - strips SAS/C keywords so the library sources
+ * compile with GCC. Force included by Host/makefile. __inline is left to
+ * GCC, which needs -fgnu89-inline to keep SAS/C meaning for it.
+ */
+#ifndef SASC_COMPAT_H
+#define SASC_COMPAT_H
+
+#define __asm
+#define __saveds
+#define __interrupt
+#define __stdargs
+#define __regargs
+#define __far
+#define __near
+#define __chip
+
+#define __d0
+#define __d1
+#define __d2
+#define __d3
+#define __d4
+#define __d5
+#define __d6
+#define __d7
+#define __a0
+#define __a1
+#define __a2
+#define __a3
+#define __a4
+#define __a5
+#define __a6
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * Simulated SPIder board for host builds of spiderdev.lib
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "spisim.h"
+#include "spider_regs.h"
+#include "amiga_hwreg.h"
+#include <hardware/intbits.h>
+
+struct SimBoard
+{
+	ULONG base;
+	BOOL used;
+	LONG int_num;
+
+	UBYTE tx[256];
+	UBYTE rx[256];
+	UBYTE tx_head, tx_tail;		// CPU writes at tail, shifter takes from head
+	UBYTE rx_head, rx_tail;		// shifter writes at tail, CPU takes from head
+	UBYTE upper;
+	UWORD feed;
+	UWORD discard;
+	UBYTE freq;
+	UBYTE slave_select;
+	UBYTE gpios;
+	UBYTE int_fired;
+	UBYTE int_armed;
+	UBYTE reset_pin;
+	UBYTE ident[IDENT_SIZE];
+	UBYTE ident_pos;
+
+	uint64_t shift_ns;			// time owed to the shifter
+	uint64_t last_ns;
+
+	SPISIM_DEVICE device;
+	void *userdata;
+
+	struct SpiSimStats stats;
+};
+
+static struct SimBoard boards[SPISIM_MAX_BOARDS];
+static uint64_t now_ns;
+static ULONG bus_ns = SPISIM_DEFAULT_BUS_NS;
+static ULONG spin_ns = SPISIM_DEFAULT_SPIN_NS;
+
+static UBYTE loopback(void *userdata, UBYTE mosi, UBYTE slave_select)
+{
+	return mosi;
+}
+
+static struct SimBoard *find_board(ULONG base)
+{
+	int i = 0;
+
+	for (; i < SPISIM_MAX_BOARDS; i++){
+		if (boards[i].used && boards[i].base == base){
+			return &boards[i];
+		}
+	}
+	return NULL;
+}
+
+// Clockport windows are 64 bytes, registers on every fourth byte
+static struct SimBoard *decode(volatile UBYTE *addr, int *reg)
+{
+	ULONG a = (ULONG)(uintptr_t)addr;
+	int i = 0;
+
+	for (; i < SPISIM_MAX_BOARDS; i++){
+		if (boards[i].used && a >= boards[i].base && a < boards[i].base + (SPIDER_REG_COUNT << 2)){
+			*reg = (a - boards[i].base) >> 2;
+			return &boards[i];
+		}
+	}
+	return NULL;
+}
+
+static uint64_t byte_ns(UBYTE freq)
+{
+	uint64_t hz = (freq & 0x80) ? (uint64_t)(freq & 0x7F) * 1000000 : (uint64_t)freq * 1000;
+
+	if (!hz){
+		hz = 1000;
+	}
+	return 8000000000ULL / hz;
+}
+
+// Run the shifter for the time that has gone since the last access
+static void advance(struct SimBoard *b)
+{
+	uint64_t per_byte = byte_ns(b->freq);
+	UBYTE mosi = 0, miso = 0;
+
+	b->shift_ns += now_ns - b->last_ns;
+	b->last_ns = now_ns;
+
+	while (b->shift_ns >= per_byte){
+		if (b->tx_head != b->tx_tail){
+			mosi = b->tx[b->tx_head];
+		}else if (b->feed){
+			mosi = 0xFF;
+		}else{
+			// Idle bus does not bank time
+			b->shift_ns = 0;
+			break;
+		}
+
+		if (!b->discard && (UBYTE)(b->rx_tail + 1) == b->rx_head){
+			b->stats.rx_stalls++;
+			b->shift_ns = 0;
+			break;
+		}
+
+		if (b->tx_head != b->tx_tail){
+			b->tx_head++;
+		}else{
+			b->feed--;
+		}
+
+		miso = b->device(b->userdata, mosi, b->slave_select);
+		if (b->discard){
+			b->discard--;
+		}else{
+			b->rx[b->rx_tail++] = miso;
+		}
+		b->stats.spi_bytes++;
+		b->shift_ns -= per_byte;
+	}
+}
+
+static void bus_cycle(struct SimBoard *b)
+{
+	now_ns += bus_ns;
+	b->stats.bus_ns += bus_ns;
+	advance(b);
+}
+
+static void fire(struct SimBoard *b, UBYTE changed)
+{
+	if (changed & b->int_armed){
+		b->int_fired |= changed & b->int_armed;
+		host_raise_interrupt(b->int_num);
+	}
+}
+
+int spisim_attach(ULONG base, UBYTE fw_major, UBYTE fw_minor, UBYTE fw_patch, LONG int_num)
+{
+	static const UBYTE ident_str[] = {0xff, 's', 'p', 'd', 'r'};
+	struct SimBoard *b = find_board(base);
+	int i = 0;
+
+	for (; !b && i < SPISIM_MAX_BOARDS; i++){
+		if (!boards[i].used){
+			b = &boards[i];
+		}
+	}
+	if (!b){
+		return -1;
+	}
+
+	memset(b, 0, sizeof(struct SimBoard));
+	b->used = TRUE;
+	b->base = base;
+	b->int_num = int_num;
+	b->device = loopback;
+	b->last_ns = now_ns;
+	memcpy(b->ident, ident_str, sizeof(ident_str));
+	b->ident[5] = fw_major;
+	b->ident[6] = fw_minor;
+	b->ident[7] = fw_patch;
+	return 0;
+}
+
+void spisim_detach_all(void)
+{
+	memset(boards, 0, sizeof(boards));
+}
+
+void spisim_set_costs(ULONG bus, ULONG spin)
+{
+	bus_ns = bus;
+	spin_ns = spin;
+}
+
+void spisim_set_device(ULONG base, SPISIM_DEVICE device, void *userdata)
+{
+	struct SimBoard *b = find_board(base);
+
+	if (b){
+		b->device = device ? device : loopback;
+		b->userdata = userdata;
+	}
+}
+
+void spisim_set_gpios(ULONG base, UBYTE value)
+{
+	struct SimBoard *b = find_board(base);
+	UBYTE changed = 0;
+
+	if (b){
+		advance(b);
+		changed = b->gpios ^ value;
+		b->gpios = value;
+		fire(b, changed);
+	}
+}
+
+void spisim_get_stats(ULONG base, struct SpiSimStats *stats)
+{
+	struct SimBoard *b = find_board(base);
+
+	if (b){
+		*stats = b->stats;
+	}else{
+		memset(stats, 0, sizeof(struct SpiSimStats));
+	}
+}
+
+void spisim_reset_stats(ULONG base)
+{
+	struct SimBoard *b = find_board(base);
+
+	if (b){
+		memset(&b->stats, 0, sizeof(struct SpiSimStats));
+	}
+}
+
+ULONG spisim_total_accesses(const struct SpiSimStats *stats)
+{
+	ULONG total = 0;
+	int i = 0;
+
+	for (; i < 16; i++){
+		total += stats->reads[i] + stats->writes[i];
+	}
+	return total;
+}
+
+uint64_t spisim_now_ns(void)
+{
+	return now_ns;
+}
+
+void spisim_advance_ns(uint64_t ns)
+{
+	int i = 0;
+
+	now_ns += ns;
+	for (; i < SPISIM_MAX_BOARDS; i++){
+		if (boards[i].used){
+			advance(&boards[i]);
+		}
+	}
+}
+
+// CIA TOD counts vertical blanks, 50 Hz on PAL. Reading it is three CIA
+// accesses, each synchronised to the EClock.
+ULONG spisim_tod_ticks(void)
+{
+	now_ns += 3 * SPISIM_CIA_NS;
+	return (ULONG)(now_ns / 20000000ULL) & 0x00FFFFFF;
+}
+
+UBYTE spisim_read(volatile UBYTE *addr)
+{
+	struct SimBoard *b = NULL;
+	int reg = 0;
+	UBYTE val = 0xFF;
+
+	if (!(b = decode(addr, &reg))){
+		// Nothing decoded, the bus floats
+		now_ns += bus_ns;
+		return 0xFF;
+	}
+	bus_cycle(b);
+	b->stats.reads[reg]++;
+
+	switch (reg){
+	case REG_STATUS:
+		val = b->discard ? 0 : STATUS_RX_DISCARD_EMPTY;
+		break;
+	case REG_GPIOS:
+		val = b->gpios;
+		break;
+	case REG_RX_HEAD:
+		val = b->rx_head;
+		break;
+	case REG_RX_TAIL:
+		val = b->rx_tail;
+		break;
+	case REG_TX_HEAD:
+		val = b->tx_head;
+		break;
+	case REG_TX_TAIL:
+		val = b->tx_tail;
+		break;
+	case REG_INT_FIRED:
+		val = b->int_fired;
+		break;
+	case REG_FIFO:
+		if (b->rx_head != b->rx_tail){
+			val = b->rx[b->rx_head++];
+		}else{
+			b->stats.fifo_underruns++;
+		}
+		break;
+	case REG_IDENT:
+		val = b->ident[b->ident_pos];
+		b->ident_pos = (b->ident_pos + 1) & (IDENT_SIZE - 1);
+		break;
+	}
+	return val;
+}
+
+void spisim_write(volatile UBYTE *addr, UBYTE val)
+{
+	struct SimBoard *b = NULL;
+	int reg = 0;
+
+	if (!(b = decode(addr, &reg))){
+		now_ns += bus_ns;
+		return;
+	}
+	bus_cycle(b);
+	b->stats.writes[reg]++;
+
+	switch (reg){
+	case REG_UPPER_LENGTH:
+		b->upper = val;
+		break;
+	case REG_RESET:
+		b->reset_pin = val;
+		break;
+	case REG_RX_DISCARD:
+		b->discard = ((UWORD)b->upper << 8) | val;
+		break;
+	case REG_TX_FEED:
+		b->feed = ((UWORD)b->upper << 8) | val;
+		break;
+	case REG_SPI_FREQ:
+		b->freq = val;
+		break;
+	case REG_SLAVE_SELECT:
+		b->slave_select = val;
+		break;
+	case REG_INT_FIRED:
+		b->int_fired = val;
+		break;
+	case REG_INT_ARMED:
+		b->int_armed = val;
+		break;
+	case REG_FIFO:
+		if ((UBYTE)(b->tx_tail + 1) != b->tx_head){
+			b->tx[b->tx_tail++] = val;
+		}else{
+			b->stats.fifo_overruns++;
+		}
+		break;
+	}
+}
+
+void spisim_spin(ULONG iters)
+{
+	int i = 0;
+
+	now_ns += (uint64_t)iters * spin_ns;
+	for (; i < SPISIM_MAX_BOARDS; i++){
+		if (boards[i].used){
+			boards[i].stats.spin_iters += iters;
+		}
+	}
+}
+
+// Only TBE is modelled: the transmitter is always ready, so while the
+// interrupt is enabled it is taken again after every byte.
+static UWORD intena;
+
+void spisim_custom_write(ULONG reg, UWORD val)
+{
+	static BOOL in_tbe;
+
+	switch (reg){
+	case SERDAT:
+		fputc(SERDATR_DB8_of(val), stderr);
+		break;
+	case INTENA:
+		if (val & INTF_SETCLR){
+			intena |= val & ~INTF_SETCLR;
+		}else{
+			intena &= ~val;
+		}
+		break;
+	case INTREQ:
+		if ((val & INTF_SETCLR) && (val & INTF_TBE) && !in_tbe){
+			in_tbe = TRUE;
+			while (intena & INTF_TBE){
+				host_raise_interrupt(INTB_TBE);
+			}
+			in_tbe = FALSE;
+		}
+		break;
+	}
+}
+
+UWORD spisim_custom_read(ULONG reg)
+{
+	// Transmitter always ready, nothing received
+	return reg == SERDATR ? (SERDATR_TBE | SERDATR_TSRE) : 0;
+}
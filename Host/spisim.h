@@ -0,0 +1,71 @@
+/*
+ * Simulated SPIder board for host builds of spiderdev.lib
+ *
+ * Models the firmware registers from Src/spider_regs.h: 256 byte TX/RX
+ * rings with head/tail, REG_UPPER_LENGTH with RX_DISCARD/TX_FEED, GPIO
+ * interrupts through INT_FIRED/INT_ARMED and the rotating REG_IDENT.
+ *
+ * Time only moves when the library touches the board. Every register
+ * access costs bus_ns and every CPU_SPIN() iteration costs spin_ns, the
+ * SPI shifter runs at the REG_SPI_FREQ rate against that clock.
+ */
+#ifndef SPISIM_H_
+#define SPISIM_H_
+
+#include <stdint.h>
+#include <exec/types.h>
+
+#define SPISIM_MAX_BOARDS		8
+
+#define SPISIM_DEFAULT_BUS_NS	560		// one clockport cycle
+#define SPISIM_DEFAULT_SPIN_NS	40		// one poll spin loop iteration
+#define SPISIM_CIA_NS			1400	// one CIA register access
+
+#define SPISIM_ECLOCK_FREQ		709379	// PAL EClock
+
+// Returns the byte clocked back from the device for each byte sent
+typedef UBYTE (*SPISIM_DEVICE)(void *userdata, UBYTE mosi, UBYTE slave_select);
+
+struct SpiSimStats
+{
+	ULONG reads[16];			// per register
+	ULONG writes[16];
+	ULONG fifo_underruns;		// REG_FIFO read with RX empty
+	ULONG fifo_overruns;		// REG_FIFO write with TX full
+	ULONG rx_stalls;			// shifter held off by a full RX ring
+	uint64_t spi_bytes;			// bytes clocked on the bus
+	uint64_t bus_ns;			// time spent in register accesses
+	uint64_t spin_iters;
+};
+
+// Board set up. base is the clockport address passed in ClockportConfig,
+// int_num the Exec interrupt (INTB_PORTS, INTB_VERTB or INTB_EXTER) it raises.
+int spisim_attach(ULONG base, UBYTE fw_major, UBYTE fw_minor, UBYTE fw_patch, LONG int_num);
+void spisim_detach_all(void);
+void spisim_set_costs(ULONG bus_ns, ULONG spin_ns);
+void spisim_set_device(ULONG base, SPISIM_DEVICE device, void *userdata);
+// Change the GPIO pins 20-27, edges on armed pins fire the board interrupt
+void spisim_set_gpios(ULONG base, UBYTE value);
+
+void spisim_get_stats(ULONG base, struct SpiSimStats *stats);
+void spisim_reset_stats(ULONG base);
+ULONG spisim_total_accesses(const struct SpiSimStats *stats);
+
+// Simulated time
+uint64_t spisim_now_ns(void);
+void spisim_advance_ns(uint64_t ns);
+ULONG spisim_tod_ticks(void);
+
+// Library side, used by Src/spider_regs.h
+UBYTE spisim_read(volatile UBYTE *addr);
+void spisim_write(volatile UBYTE *addr, UBYTE val);
+void spisim_spin(ULONG iters);
+
+// Custom chip access for Src/amiga_hwreg.h, SERDAT goes to stderr
+void spisim_custom_write(ULONG reg, UWORD val);
+UWORD spisim_custom_read(ULONG reg);
+
+// Runs the interrupt servers added to int_num (amiga_stubs.c)
+void host_raise_interrupt(LONG int_num);
+
+#endif
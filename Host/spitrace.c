@@ -0,0 +1,152 @@
+/*
+ * Decodes trace_dump() files from a SPI_TRACE build of spiderdev.lib
+ *
+ * spitrace [-s us] file
+ *
+ * Prints one line per record with the time since the first record and the
+ * gap to the previous one. END records also show how long the operation
+ * took, and with -s those over the given microseconds are marked with '!'.
+ * A per-operation summary follows the timeline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+#define HEADER_SIZE		20
+#define RECORD_SIZE		16
+#define MAX_EVENT		TRACE_WAIT_END
+
+struct OpStats
+{
+	unsigned long count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+static const char *event_names[MAX_EVENT + 1] = {
+	"?", "read", "read end", "write", "write end", "transfer", "transfer end",
+	"select", "deselect", "interrupt", "wait", "wait end"
+};
+
+static uint32_t get_ulong(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static unsigned get_uword(const unsigned char *p)
+{
+	return ((unsigned)p[0] << 8) | p[1];
+}
+
+static int is_end(unsigned event)
+{
+	return event == TRACE_READ_END || event == TRACE_WRITE_END ||
+		event == TRACE_XFER_END || event == TRACE_WAIT_END;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char hdr[HEADER_SIZE], rec[RECORD_SIZE];
+	uint64_t begin_at[MAX_EVENT + 1], now = 0, prev = 0, took = 0, spike = 0;
+	struct OpStats ops[MAX_EVENT + 1];
+	uint32_t freq = 0, count = 0, lost = 0, eclock = 0, last = 0;
+	unsigned event = 0, seq = 0;
+	const char *path = NULL;
+	char name[16];
+	FILE *f = NULL;
+	uint32_t i = 0;
+
+	for (i = 1; i < (uint32_t)argc; i++){
+		if (!strcmp(argv[i], "-s") && i + 1 < (uint32_t)argc){
+			spike = strtoul(argv[++i], NULL, 10);
+		}else{
+			path = argv[i];
+		}
+	}
+	if (!path){
+		fprintf(stderr, "usage: spitrace [-s us] file\n");
+		return 5;
+	}
+	if (!(f = fopen(path, "rb"))){
+		perror(path);
+		return 10;
+	}
+	if (fread(hdr, 1, HEADER_SIZE, f) != HEADER_SIZE || get_ulong(hdr) != TRACE_MAGIC){
+		fprintf(stderr, "%s: not a trace dump\n", path);
+		return 10;
+	}
+	if (get_uword(hdr + 4) != TRACE_VERSION || get_uword(hdr + 6) != RECORD_SIZE){
+		fprintf(stderr, "%s: trace version %u not supported\n", path, get_uword(hdr + 4));
+		return 10;
+	}
+	freq = get_ulong(hdr + 8);
+	count = get_ulong(hdr + 12);
+	lost = get_ulong(hdr + 16);
+	if (!freq){
+		fprintf(stderr, "%s: no EClock frequency\n", path);
+		return 10;
+	}
+
+	printf("%lu records, %lu lost before the dump, EClock %lu Hz\n",
+		(unsigned long)count, (unsigned long)lost, (unsigned long)freq);
+	printf("%8s %12s %10s  %-13s %10s %10s %10s\n", "seq", "us", "+us", "event", "arg1", "arg2", "took us");
+
+	memset(begin_at, 0, sizeof(begin_at));
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < count && fread(rec, 1, RECORD_SIZE, f) == RECORD_SIZE; i++){
+		eclock = get_ulong(rec);
+		event = get_uword(rec + 4);
+		seq = get_uword(rec + 6);
+
+		// Only the low 32 bits are stored, step by the wrapped difference
+		if (i){
+			now += (uint32_t)(eclock - last);
+		}
+		last = eclock;
+
+		if (event <= MAX_EVENT){
+			snprintf(name, sizeof(name), "%s", event_names[event]);
+		}else{
+			snprintf(name, sizeof(name), "0x%04x", event);
+		}
+		printf("%8u %12llu %10llu  %-13s %10lu %10lu", seq,
+			(unsigned long long)(now * 1000000 / freq),
+			(unsigned long long)((now - prev) * 1000000 / freq),
+			name, (unsigned long)get_ulong(rec + 8), (unsigned long)get_ulong(rec + 12));
+		prev = now;
+
+		if (event <= MAX_EVENT && is_end(event) && begin_at[event - 1]){
+			took = (now - (begin_at[event - 1] - 1)) * 1000000 / freq;
+			begin_at[event - 1] = 0;
+			printf(" %10llu%s", (unsigned long long)took, spike && took > spike ? " !" : "");
+			if (!ops[event].count || took < ops[event].min){
+				ops[event].min = took;
+			}
+			if (took > ops[event].max){
+				ops[event].max = took;
+			}
+			ops[event].total += took;
+			ops[event].count++;
+		}else if (event < MAX_EVENT && is_end(event + 1)){
+			// Stored plus one so zero means no begin seen
+			begin_at[event] = now + 1;
+		}
+		printf("\n");
+	}
+	fclose(f);
+
+	printf("\n%-13s %8s %10s %10s %10s\n", "operation", "count", "min us", "avg us", "max us");
+	for (event = 1; event <= MAX_EVENT; event++){
+		if (ops[event].count){
+			printf("%-13s %8lu %10llu %10llu %10llu\n", event_names[event - 1], ops[event].count,
+				(unsigned long long)ops[event].min,
+				(unsigned long long)(ops[event].total / ops[event].count),
+				(unsigned long long)ops[event].max);
+		}
+	}
+	return 0;
+}
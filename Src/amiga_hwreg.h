@@ -45,6 +45,11 @@
 #define BPL1DAT			0x110
 #define COLOR00			0x180
 
+#ifdef SPI_HOST_SIM
+#include "spisim.h"
+#define reg_w(reg, val)	spisim_custom_write((reg), (val))
+#define reg_r(reg)		spisim_custom_read((reg))
+#else
 static  void reg_w(ULONG reg, UWORD val)
 {
 	volatile UWORD *r = (void *)(0xdff000 + reg);
@@ -58,5 +63,6 @@ static  UWORD reg_r(ULONG reg)
 
 	return *r;
 }
+#endif
 
 #endif /* AMIGA_HWREG_H */
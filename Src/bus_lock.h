@@ -0,0 +1,28 @@
+#ifndef __BUS_LOCK_H
+#define __BUS_LOCK_H
+
+#include <exec/types.h>
+
+/*
+ * Test and set of bit 0 of a byte, one BSET so nothing else can get in
+ * between and no Forbid() is needed. TRUE if the bit was clear and the
+ * caller now holds the lock. Only for one CPU, BSET is not a locked cycle.
+ */
+#ifdef SPI_HOST_SIM
+// Nothing runs concurrently on the host
+static __inline BOOL bus_try_lock(volatile UBYTE *lock)
+{
+	if (*lock & 1){
+		return FALSE;
+	}
+	*lock |= 1;
+	return TRUE;
+}
+#else
+BOOL __asm bus_try_lock(register __a0 volatile UBYTE *lock);
+#endif
+
+// A single byte write, as atomic as the BSET
+#define bus_unlock(lock)	(*(lock) = 0)
+
+#endif
@@ -1,15 +1,22 @@
 #include <exec/types.h>
 #include <exec/memory.h>
+#include <exec/semaphores.h>
 #include <dos/dos.h>
 
 #include <proto/exec.h>
 #include <proto/dos.h>
 
 #include <string.h>
+#include <stddef.h>
 
 #include "config_file.h"
 
 #define CONFIG_FILE_NAME    "DEVS:spisd-spider.config"
+// Both follow the layout of struct SpiConfig, change them together. A driver
+// with another layout then neither finds nor loads the other's copy.
+#define CONFIG_SEMAPHORE_NAME "spi-lib-spider config 2"
+#define CONFIG_BINARY_MAGIC 0x53504346  // 'SPCF'
+#define CONFIG_BINARY_VERSION 2
 
 // Config file parse state
 #define PS_KEY_FIRST_CHAR   0
@@ -18,7 +25,31 @@
 #define PS_VALUE            3
 #define PS_MALFORMED        4
 
+#ifndef SPI_HOST_SIM
 #define SysBase (*(struct ExecBase **)4)
+#endif
+
+// Public and never freed, openers in other programs may hold it. The name
+// lives here too so it outlasts the program that added the semaphore.
+struct SharedConfig
+{
+    struct SignalSemaphore sem;
+    UWORD version;              // CONFIG_BINARY_VERSION
+    UWORD size;                 // sizeof(struct SpiConfig)
+    struct SpiConfig config;
+    char name[sizeof(CONFIG_SEMAPHORE_NAME)];
+};
+
+#define SHARED_OF(cfg)      ((struct SharedConfig *)((UBYTE *)(cfg) - offsetof(struct SharedConfig, config)))
+
+// Precompiled file, loaded with one Read()
+struct ConfigBinary
+{
+    ULONG magic;
+    UWORD version;
+    UWORD size;                 // sizeof(struct SpiConfig)
+    struct SpiConfig config;
+};
 
 static ULONG str_to_ulong(char *p)
 {
@@ -45,32 +76,106 @@ static ULONG str_to_ulong(char *p)
     return value;
 }
 
-static void parse_config_file(struct ClockportConfig *cfg, char *buf)
+// Decimal, or hex after 0x or $. A k or M suffix scales when allowed.
+static ULONG str_to_num(char *p, BOOL scaled)
+{
+    ULONG value = 0;
+    char *end = NULL;
+
+    if (*p == '$')
+        return str_to_ulong(p + 1);
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        return str_to_ulong(p + 2);
+
+    for (end = p; *end >= '0' && *end <= '9'; end++)
+        value = value * 10 + (*end - '0');
+
+    if (end == p)
+        return (ULONG)-1;
+    if (scaled && (*end == 'k' || *end == 'K') && !end[1])
+        return value * 1000;
+    if (scaled && *end == 'M' && !end[1])
+        return value * 1000000;
+    return *end ? (ULONG)-1 : value;
+}
+
+static void parse_profile_key(struct SpiProfile *prof, char *key_ptr, char *value_ptr)
+{
+    ULONG value = str_to_num(value_ptr, strcmp(key_ptr, "MaxFrequency") == 0);
+
+    if (value == (ULONG)-1)
+        return;
+
+    if (strcmp(key_ptr, "Controller") == 0)
+    {
+        if (value < 2)
+            prof->controller = value;
+    }
+    else if (strcmp(key_ptr, "ChipSelect") == 0)
+    {
+        if (value < 0x100)
+            prof->chip_select = value;
+    }
+    else if (strcmp(key_ptr, "InterruptPins") == 0)
+    {
+        if (value < 0x100)
+            prof->interrupt_pins = value;
+    }
+    else if (strcmp(key_ptr, "MaxFrequency") == 0)
+        prof->max_frequency = value;
+    else if (strcmp(key_ptr, "Timeout") == 0)
+        prof->timeout_ms = value;
+}
+
+static void parse_config_file(struct SpiConfig *cfg, char *buf)
 {
     char *p = buf;
     char *key_ptr = buf;
     char *value_ptr = NULL;
+    char *end = NULL;
     char c = *p;
     short state = PS_KEY_FIRST_CHAR;
+    struct SpiProfile *prof = NULL;
+    BOOL in_section = FALSE;
     while (c)
     {
         if (c == '\n')
         {
             *p = 0;
 
-            if (state == PS_VALUE)
+            if (state == PS_VALUE && !in_section)
             {
                 if (strcmp(key_ptr, "ClockportAddress") == 0)
                 {
                     ULONG value = str_to_ulong(value_ptr);
                     if (value != (ULONG)-1)
-                        cfg->clockport_address = value;
+                        cfg->clockport.clockport_address = value;
                 }
                 else if (strcmp(key_ptr, "Interrupt") == 0)
                 {
                     ULONG value = str_to_ulong(value_ptr);
                     if (value == 2 || value == 3 || value == 6)
-                        cfg->interrupt_number = value;
+                        cfg->clockport.interrupt_number = value;
+                }
+                else if (strcmp(key_ptr, "Discover") == 0)
+                {
+                    ULONG value = str_to_ulong(value_ptr);
+                    if (value != (ULONG)-1)
+                        cfg->clockport.discover = value;
+                }
+            }
+            else if (state == PS_VALUE && prof)
+                parse_profile_key(prof, key_ptr, value_ptr);
+            else if (state == PS_KEY && *key_ptr == '[' && (end = strchr(key_ptr, ']')))
+            {
+                // New section, those past CONFIG_MAX_PROFILES are skipped
+                *end = 0;
+                in_section = TRUE;
+                prof = NULL;
+                if (cfg->profile_count < CONFIG_MAX_PROFILES)
+                {
+                    prof = &cfg->profiles[cfg->profile_count++];
+                    strncpy(prof->name, key_ptr + 1, CONFIG_NAME_LEN - 1);
                 }
             }
 
@@ -115,6 +220,39 @@ static void parse_config_file(struct ClockportConfig *cfg, char *buf)
     }
 }
 
+static BOOL read_binary_file(struct SpiConfig *cfg)
+{
+    struct ConfigBinary *bin = NULL;
+    BOOL ok = FALSE;
+    UWORD i = 0;
+
+    struct DosLibrary *DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 0);
+    if (DOSBase)
+    {
+        BPTR f = Open(CONFIG_BINARY_NAME, MODE_OLDFILE);
+        if (f)
+        {
+            if ((bin = AllocMem(sizeof(struct ConfigBinary), MEMF_ANY)))
+            {
+                ok = Read(f, bin, sizeof(struct ConfigBinary)) == sizeof(struct ConfigBinary) &&
+                    bin->magic == CONFIG_BINARY_MAGIC && bin->version == CONFIG_BINARY_VERSION &&
+                    bin->size == sizeof(struct SpiConfig) && bin->config.profile_count <= CONFIG_MAX_PROFILES;
+                if (ok)
+                {
+                    *cfg = bin->config;
+                    for (i = 0; i < cfg->profile_count; i++)
+                        cfg->profiles[i].name[CONFIG_NAME_LEN - 1] = 0;
+                }
+                FreeMem(bin, sizeof(struct ConfigBinary));
+            }
+            Close(f);
+        }
+        CloseLibrary((struct Library *)DOSBase);
+    }
+
+    return ok;
+}
+
 static char *read_config_file(LONG *length_out)
 {
     char *buf = NULL;
@@ -153,13 +291,174 @@ static char *read_config_file(LONG *length_out)
     return buf;
 }
 
-void read_and_parse_config_file(struct ClockportConfig *cfg)
+static BOOL read_text_file(struct SpiConfig *cfg)
 {
     LONG length = 0;
     char *buf = read_config_file(&length);
-    if (buf)
+
+    if (!buf)
+        return FALSE;
+    parse_config_file(cfg, buf);
+    FreeMem(buf, length + 2);
+    return TRUE;
+}
+
+static BOOL binary_file_exists(void)
+{
+    BOOL found = FALSE;
+    BPTR f = 0;
+
+    struct DosLibrary *DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 0);
+    if (DOSBase)
+    {
+        if ((f = Open(CONFIG_BINARY_NAME, MODE_OLDFILE)))
+        {
+            found = TRUE;
+            Close(f);
+        }
+        CloseLibrary((struct Library *)DOSBase);
+    }
+    return found;
+}
+
+// Zero clockport fields mean the file did not set them
+static void load_config(struct SpiConfig *cfg)
+{
+    memset(cfg, 0, sizeof(struct SpiConfig));
+    if (!read_binary_file(cfg))
+        read_text_file(cfg);
+}
+
+const struct SpiConfig *config_obtain(void)
+{
+    struct SharedConfig *shared = NULL, *fresh = NULL;
+
+    Forbid();
+    if (!(shared = (struct SharedConfig *)FindSemaphore(CONFIG_SEMAPHORE_NAME)))
+    {
+        // First user since boot. Read outside Forbid(), DOS can wait.
+        Permit();
+        if (!(fresh = AllocMem(sizeof(struct SharedConfig), MEMF_PUBLIC | MEMF_CLEAR)))
+            return NULL;
+        load_config(&fresh->config);
+        fresh->version = CONFIG_BINARY_VERSION;
+        fresh->size = sizeof(struct SpiConfig);
+        InitSemaphore(&fresh->sem);
+        strcpy(fresh->name, CONFIG_SEMAPHORE_NAME);
+        fresh->sem.ss_Link.ln_Name = fresh->name;
+
+        Forbid();
+        // Someone else may have got there while this one was reading
+        if ((shared = (struct SharedConfig *)FindSemaphore(CONFIG_SEMAPHORE_NAME)))
+            FreeMem(fresh, sizeof(struct SharedConfig));
+        else
+        {
+            AddSemaphore(&fresh->sem);
+            shared = fresh;
+        }
+    }
+    if (shared->version != CONFIG_BINARY_VERSION || shared->size != sizeof(struct SpiConfig))
+    {
+        // Same name from a build with another struct packing
+        Permit();
+        return NULL;
+    }
+    ObtainSemaphoreShared(&shared->sem);
+    Permit();
+
+    return &shared->config;
+}
+
+void config_release(const struct SpiConfig *cfg)
+{
+    if (cfg)
+        ReleaseSemaphore(&SHARED_OF(cfg)->sem);
+}
+
+const struct SpiProfile *config_find_profile(const struct SpiConfig *cfg, const char *name)
+{
+    UWORD i = 0;
+
+    for (; i < cfg->profile_count; i++)
+    {
+        if (strcmp(cfg->profiles[i].name, name) == 0)
+            return &cfg->profiles[i];
+    }
+    return NULL;
+}
+
+BOOL config_reload(void)
+{
+    struct SharedConfig *shared = NULL;
+    struct SpiConfig *cfg = NULL;
+    const struct SpiConfig *cur = NULL;
+    BOOL text = FALSE;
+
+    if (!(cur = config_obtain()))
+        return FALSE;
+    shared = SHARED_OF(cur);
+    config_release(cur);
+
+    if (!(cfg = AllocMem(sizeof(struct SpiConfig), MEMF_ANY | MEMF_CLEAR)))
+        return FALSE;
+    // The text file is what gets edited, the binary only stands in for it
+    if (!(text = read_text_file(cfg)))
+        read_binary_file(cfg);
+
+    ObtainSemaphore(&shared->sem);
+    shared->config = *cfg;
+    ReleaseSemaphore(&shared->sem);
+    FreeMem(cfg, sizeof(struct SpiConfig));
+
+    // Keep a precompiled copy from hiding the edits at the next boot
+    if (text && binary_file_exists())
+        return config_save_binary(CONFIG_BINARY_NAME);
+    return TRUE;
+}
+
+BOOL config_save_binary(const char *path)
+{
+    struct ConfigBinary *bin = NULL;
+    const struct SpiConfig *cfg = NULL;
+    BOOL ok = FALSE;
+    struct DosLibrary *DOSBase = NULL;
+    BPTR f = 0;
+
+    if (!(bin = AllocMem(sizeof(struct ConfigBinary), MEMF_ANY | MEMF_CLEAR)))
+        return FALSE;
+    if ((cfg = config_obtain()))
+    {
+        bin->magic = CONFIG_BINARY_MAGIC;
+        bin->version = CONFIG_BINARY_VERSION;
+        bin->size = sizeof(struct SpiConfig);
+        bin->config = *cfg;
+        config_release(cfg);
+
+        if ((DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 0)))
+        {
+            if ((f = Open((STRPTR)path, MODE_NEWFILE)))
+            {
+                ok = Write(f, bin, sizeof(struct ConfigBinary)) == sizeof(struct ConfigBinary);
+                Close(f);
+            }
+            CloseLibrary((struct Library *)DOSBase);
+        }
+    }
+    FreeMem(bin, sizeof(struct ConfigBinary));
+    return ok;
+}
+
+void read_and_parse_config_file(struct ClockportConfig *cfg)
+{
+    const struct SpiConfig *shared = config_obtain();
+
+    if (shared)
     {
-        parse_config_file(cfg, buf);
-        FreeMem(buf, length + 2);
+        if (shared->clockport.clockport_address)
+            cfg->clockport_address = shared->clockport.clockport_address;
+        if (shared->clockport.interrupt_number)
+            cfg->interrupt_number = shared->clockport.interrupt_number;
+        cfg->discover = shared->clockport.discover;
+        config_release(shared);
     }
 }
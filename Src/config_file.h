@@ -4,6 +4,71 @@ struct ClockportConfig
 {
     ULONG clockport_address;
     ULONG interrupt_number;
+    ULONG discover;             // non-zero: try the other clockports when none answers here
+};
+
+/*
+ * Named device profiles follow the global keys as [name] sections:
+ *
+ *   ClockportAddress=D80001
+ *   Interrupt=6
+ *   Discover=1
+ *   [sdcard]
+ *   Controller=0
+ *   MaxFrequency=16M
+ *   InterruptPins=$04
+ *   Timeout=250
+ *
+ * ClockportAddress and Interrupt stay bare hex as before. Discover=1 lets
+ * spi_initialize() look for the board on the other clockports, it is off
+ * by default. Profile keys are
+ * decimal or hex with a 0x or $ prefix, MaxFrequency also takes a k or M
+ * suffix. Zero or a missing key leaves the library default.
+ */
+#define CONFIG_MAX_PROFILES     8
+#define CONFIG_NAME_LEN         16
+
+struct SpiProfile
+{
+    char name[CONFIG_NAME_LEN];
+    UBYTE controller;
+    UBYTE chip_select;          // REG_SLAVE_SELECT value, 0 for the controller's own
+    UBYTE interrupt_pins;       // pins to arm, 0 for all free pins
+    UBYTE pad;
+    ULONG max_frequency;        // Hz
+    ULONG timeout_ms;
+};
+
+struct SpiConfig
+{
+    struct ClockportConfig clockport;
+    UWORD profile_count;
+    UWORD pad;
+    struct SpiProfile profiles[CONFIG_MAX_PROFILES];
 };
 
 extern void read_and_parse_config_file(struct ClockportConfig *cfg);
+
+/*
+ * The config is read once per boot into a public semaphore, later callers
+ * only take the lock. The precompiled form in CONFIG_BINARY_NAME is tried
+ * before the text file and loads with a single Read().
+ *
+ * config_obtain() returns it locked shared, NULL without memory or if the
+ * shared copy was made by a build with another struct SpiConfig layout.
+ * Every call needs a config_release().
+ */
+extern const struct SpiConfig *config_obtain(void);
+extern void config_release(const struct SpiConfig *cfg);
+extern const struct SpiProfile *config_find_profile(const struct SpiConfig *cfg, const char *name);
+// Reads the text file again into the shared copy, for preference tools. A binary at
+// CONFIG_BINARY_NAME is rewritten from it, as it is loaded in preference at boot.
+extern BOOL config_reload(void);
+// Precompiles the current config to path, normally CONFIG_BINARY_NAME
+extern BOOL config_save_binary(const char *path);
+
+#define CONFIG_BINARY_NAME      "DEVS:spisd-spider.config.bin"
+
+// Used by spi_open_profile() when the file does not set them
+#define CONFIG_DEFAULT_CLOCKPORT    0xD80001
+#define CONFIG_DEFAULT_INTERRUPT    6
@@ -0,0 +1,164 @@
+/*
+ * FIFO copy kernels for spiderdev.lib
+ * Compiled three times by the makefile with CPU= and one of
+ * COPY_KERNEL_000, COPY_KERNEL_020 or COPY_KERNEL_040 defined.
+ *
+ * Every FIFO access is a slow clockport bus cycle. The kernels keep the
+ * loop overhead and the memory side to a minimum around those accesses.
+ */
+#include <exec/types.h>
+
+#include "copy_kernels.h"
+#include "spider_regs.h"
+
+#if defined(COPY_KERNEL_040)
+#define KERNEL(name)		name##_040
+#define UNROLL_LONGS		8
+#elif defined(COPY_KERNEL_020)
+#define KERNEL(name)		name##_020
+#define UNROLL_LONGS		4
+#else
+#define KERNEL(name)		name##_000
+#endif
+
+#ifdef UNROLL_LONGS
+
+// Byte lane shifts for the first to fourth FIFO byte within a long
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LANE0	0
+#define LANE1	8
+#define LANE2	16
+#define LANE3	24
+#else
+#define LANE0	24
+#define LANE1	16
+#define LANE2	8
+#define LANE3	0
+#endif
+
+#define FIFO_TO_LONG(dst, reg)	{ ULONG v_ = (ULONG)FIFO_RD(reg) << LANE0; v_ |= (ULONG)FIFO_RD(reg) << LANE1; v_ |= (ULONG)FIFO_RD(reg) << LANE2; *(dst)++ = v_ | ((ULONG)FIFO_RD(reg) << LANE3); }
+#define LONG_TO_FIFO(reg, src)	{ ULONG v_ = *(src)++; FIFO_WR(reg, v_ >> LANE0); FIFO_WR(reg, v_ >> LANE1); FIFO_WR(reg, v_ >> LANE2); FIFO_WR(reg, v_ >> LANE3); }
+
+void KERNEL(copy_from_fifo)(UBYTE *dst, volatile UBYTE *reg, UWORD length)
+{
+	ULONG *ldst = NULL;
+	WORD n = 0;
+
+	// Byte reads until the destination is long aligned
+	while (length && (PTR_BITS(dst) & 3)){
+		*dst++ = FIFO_RD(reg);
+		length--;
+	}
+
+	ldst = (ULONG *)dst;
+	n = length / (UNROLL_LONGS * 4);
+	while (--n >= 0){
+		FIFO_TO_LONG(ldst, reg);
+		FIFO_TO_LONG(ldst, reg);
+		FIFO_TO_LONG(ldst, reg);
+		FIFO_TO_LONG(ldst, reg);
+#if UNROLL_LONGS == 8
+		FIFO_TO_LONG(ldst, reg);
+		FIFO_TO_LONG(ldst, reg);
+		FIFO_TO_LONG(ldst, reg);
+		FIFO_TO_LONG(ldst, reg);
+#endif
+	}
+	n = (length >> 2) & (UNROLL_LONGS - 1);
+	while (--n >= 0){
+		FIFO_TO_LONG(ldst, reg);
+	}
+
+	dst = (UBYTE *)ldst;
+	n = length & 3;
+	while (--n >= 0){
+		*dst++ = FIFO_RD(reg);
+	}
+}
+
+void KERNEL(copy_to_fifo)(volatile UBYTE *reg, const UBYTE *src, UWORD length)
+{
+	const ULONG *lsrc = NULL;
+	WORD n = 0;
+
+	// Byte writes until the source is long aligned
+	while (length && (PTR_BITS(src) & 3)){
+		FIFO_WR(reg, *src++);
+		length--;
+	}
+
+	lsrc = (const ULONG *)src;
+	n = length / (UNROLL_LONGS * 4);
+	while (--n >= 0){
+		LONG_TO_FIFO(reg, lsrc);
+		LONG_TO_FIFO(reg, lsrc);
+		LONG_TO_FIFO(reg, lsrc);
+		LONG_TO_FIFO(reg, lsrc);
+#if UNROLL_LONGS == 8
+		LONG_TO_FIFO(reg, lsrc);
+		LONG_TO_FIFO(reg, lsrc);
+		LONG_TO_FIFO(reg, lsrc);
+		LONG_TO_FIFO(reg, lsrc);
+#endif
+	}
+	n = (length >> 2) & (UNROLL_LONGS - 1);
+	while (--n >= 0){
+		LONG_TO_FIFO(reg, lsrc);
+	}
+
+	src = (const UBYTE *)lsrc;
+	n = length & 3;
+	while (--n >= 0){
+		FIFO_WR(reg, *src++);
+	}
+}
+
+#else
+
+// 68000 has no unaligned long access and gains nothing from long stores
+// to 16 bit memory. Counters are WORDs tested with --n >= 0 so the loops
+// compile to DBRA.
+
+void KERNEL(copy_from_fifo)(UBYTE *dst, volatile UBYTE *reg, UWORD length)
+{
+	WORD n = length & 7;
+
+	while (--n >= 0){
+		*dst++ = FIFO_RD(reg);
+	}
+
+	n = length >> 3;
+	while (--n >= 0){
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+		*dst++ = FIFO_RD(reg);
+	}
+}
+
+void KERNEL(copy_to_fifo)(volatile UBYTE *reg, const UBYTE *src, UWORD length)
+{
+	WORD n = length & 7;
+
+	while (--n >= 0){
+		FIFO_WR(reg, *src++);
+	}
+
+	n = length >> 3;
+	while (--n >= 0){
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+		FIFO_WR(reg, *src++);
+	}
+}
+
+#endif
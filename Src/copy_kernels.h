@@ -0,0 +1,24 @@
+/*
+ * FIFO copy kernels for spiderdev.lib
+ * copy_kernels.c is built once per CPU family, spi_initialize() picks the
+ * variant to use from SysBase->AttnFlags.
+ */
+#ifndef COPY_KERNELS_H_
+#define COPY_KERNELS_H_
+
+#include <exec/types.h>
+
+typedef void (*COPY_FROM_FUNC)(UBYTE *dst, volatile UBYTE *reg, UWORD length);
+typedef void (*COPY_TO_FUNC)(volatile UBYTE *reg, const UBYTE *src, UWORD length);
+
+// 68000/010 - byte moves unrolled by 8, DBRA counted
+void copy_from_fifo_000(UBYTE *dst, volatile UBYTE *reg, UWORD length);
+void copy_to_fifo_000(volatile UBYTE *reg, const UBYTE *src, UWORD length);
+// 68020/030 - aligned 32 bit memory accesses, unrolled by 16 bytes
+void copy_from_fifo_020(UBYTE *dst, volatile UBYTE *reg, UWORD length);
+void copy_to_fifo_020(volatile UBYTE *reg, const UBYTE *src, UWORD length);
+// 68040/060 - aligned 32 bit memory accesses, unrolled by 32 bytes
+void copy_from_fifo_040(UBYTE *dst, volatile UBYTE *reg, UWORD length);
+void copy_to_fifo_040(volatile UBYTE *reg, const UBYTE *src, UWORD length);
+
+#endif
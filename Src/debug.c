@@ -1,4 +1,7 @@
 #include <hardware/intbits.h>
+#include <exec/interrupts.h>
+#include <exec/execbase.h>
+#include <proto/exec.h>
 #include "amiga_hwreg.h"
 #include "debug.h"
 #include <stdarg.h>
@@ -13,6 +16,74 @@
 // TO DO: rethink this for devices as stdio could cause crashes and therefore should not use
 int g__debug_level ;
 
+// Serial output goes through a ring drained by the TBE interrupt once
+// DebugInit() has installed it, so callers never wait on the UART. Until
+// then, or after DebugShutdown(), characters are sent polled as before.
+#define LOG_RING_SIZE		4096	// power of 2
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+
+static UBYTE log_ring[LOG_RING_SIZE];
+static volatile UWORD log_head;		// next free slot, moved by writers under Disable()
+static volatile UWORD log_tail;		// next to send, moved by the TBE interrupt
+static volatile BOOL log_busy;		// TBE interrupt enabled and draining
+static ULONG log_dropped;
+static BOOL log_async;
+
+#ifdef DEBUG_SERIAL
+static struct Interrupt log_int;
+static struct Interrupt *log_old_tbe;
+
+static const char log_name[] = "spi-lib-spider log";
+
+static void __interrupt __saveds __asm log_tbe(register __a1 APTR data)
+{
+	reg_w(INTREQ, INTF_TBE);
+	if (log_tail != log_head){
+		reg_w(SERDAT, SERDAT_STP8 | SERDAT_DB8(log_ring[log_tail]));
+		log_tail = (log_tail + 1) & LOG_RING_MASK;
+	}else{
+		reg_w(INTENA, INTF_TBE);
+		log_busy = FALSE;
+	}
+}
+#endif
+
+// Call under Disable()
+static void log_put(UBYTE c)
+{
+	UWORD next = (log_head + 1) & LOG_RING_MASK;
+
+	if (next == log_tail){
+		log_dropped++;
+		return;
+	}
+	log_ring[log_head] = c;
+	log_head = next;
+}
+
+// Call under Disable(), the interrupt is taken once interrupts are enabled again
+static void log_kick(void)
+{
+	if (!log_busy && log_tail != log_head){
+		log_busy = TRUE;
+		reg_w(INTENA, INTF_SETCLR | INTF_TBE);
+		reg_w(INTREQ, INTF_SETCLR | INTF_TBE);
+	}
+}
+
+static void log_str(const char *str)
+{
+	Disable();
+	for (; *str; str++){
+		if (*str == '\n'){
+			log_put('\r');
+		}
+		log_put(*str);
+	}
+	log_kick();
+	Enable();
+}
+
 void DebugPrint(int level, char *format, ...)
 {
 #ifdef DEBUG_SERIAL
@@ -43,14 +114,71 @@ void DebugInit(int level)
 	*ciab_ddra = 0xc0;  /* Only DTR and RTS are driven as outputs */
 	*ciab_pra = 0;      /* Turn on DTR and RTS */
 
-	/* Set the debug UART to 9600 */
-	reg_w(SERPER, SERPER_BAUD(SERPER_BASE_PAL, 9600));
+	DebugSetBaud(DEBUG_DEFAULT_BAUD);
+
+	if (!log_async){
+		log_int.is_Node.ln_Type = NT_INTERRUPT;
+		log_int.is_Node.ln_Name = (char *)log_name;
+		log_int.is_Data = NULL;
+		log_int.is_Code = (void (*)())log_tbe;
+
+		// Takes TBE from serial.device if it is open, DebugShutdown() gives it back.
+		// serial.device gets no TBE interrupts until then.
+		Disable();
+		reg_w(INTENA, INTF_TBE);
+		log_old_tbe = SetIntVector(INTB_TBE, &log_int);
+		log_busy = FALSE;
+		log_async = TRUE;
+		log_kick();
+		Enable();
+	}
 #endif
 	g__debug_level = level ;
 }
 
+void DebugShutdown(void)
+{
+#ifdef DEBUG_SERIAL
+	if (log_async){
+		// Let the ring drain, the interrupt stops itself when it is empty
+		while (log_busy){
+		}
+		Disable();
+		reg_w(INTENA, INTF_TBE);
+		SetIntVector(INTB_TBE, log_old_tbe);
+		log_async = FALSE;
+		Enable();
+	}
+#endif
+}
+
+void DebugSetBaud(ULONG baud)
+{
+	ULONG base = SysBase->VBlankFrequency == 60 ? SERPER_BASE_NTSC : SERPER_BASE_PAL;
+
+	if (baud){
+		reg_w(SERPER, SERPER_BAUD(base, baud));
+	}
+}
+
+ULONG DebugDropped(void)
+{
+	return log_dropped;
+}
+
 int DebugPutChar(register int chr)
 {
+	if (log_async){
+		Disable();
+		if (chr == '\n'){
+			log_put('\r');
+		}
+		log_put(chr);
+		log_kick();
+		Enable();
+		return 1;
+	}
+
 	if (chr == '\n')
 		DebugPutChar('\r');
 
@@ -80,6 +208,10 @@ int DebugMayGetChar(void)
 
 void DebugPutStr(register const char *buff)
 {
+	if (log_async){
+		log_str(buff);
+		return;
+	}
 	for (; *buff != 0; buff++)
 		DebugPutChar(*buff);
 }
@@ -35,8 +35,21 @@
 #define DebugPrint8(l,f,x1,x2,x3,x4,x5,x6,x7,x8)
 #endif
 
-// Must Init before calling other functions as it sets the level
+#ifndef DEBUG_DEFAULT_BAUD
+#define DEBUG_DEFAULT_BAUD	9600
+#endif
+
+// Must Init before calling other functions as it sets the level. With DEBUG_SERIAL
+// it also takes the TBE interrupt so output is queued and sent in the background.
+// The old TBE handler is kept and put back by DebugShutdown(), but in between the
+// port cannot be shared: serial.device output stalls while a debug build is running.
 void DebugInit(int level);
+// Waits for queued output to go and hands the TBE interrupt back
+void DebugShutdown(void);
+// Serial rate, 115200 and above work on a stock UART
+void DebugSetBaud(ULONG baud);
+// Characters lost to a full output ring
+ULONG DebugDropped(void);
 void DebugPrint(int level, char *format, ...);
 int DebugPutChar(register int chr);
 int DebugMayGetChar(void);
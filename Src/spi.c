@@ -6,273 +6,1499 @@
 #include <exec/types.h>
 #include <exec/interrupts.h>
 #include <exec/libraries.h>
+#include <exec/memory.h>
+#include <exec/execbase.h>
+#include <exec/tasks.h>
 
 #include <hardware/intbits.h>
 
+#include <dos/dos.h>
+#include <dos/var.h>
+
 #include <proto/exec.h>
+#include <proto/dos.h>
+#include <clib/alib_protos.h>
 #include <string.h>
 
 #include "spi.h"
 #include "config_file.h"
 #include "debug.h"
 #include "timing.h"
-
-#define REG_STATUS          	0	// RO
-#define REG_RESERVED_1          1
-#define REG_UPPER_LENGTH        2   // WO, Upper byte for lengths
-#define REG_GPIOS 		        3   // RO, Read GPIO values 20-27
-#define REG_RESET				4	// WO, Set value of pin 29
-#define REG_RX_HEAD             4   // RO
-#define REG_RX_TAIL             5   // RO
-#define REG_TX_HEAD             6   // RO
-#define REG_TX_TAIL             7   // RO
-#define REG_RX_DISCARD          8   // WO, Lower byte
-#define REG_TX_FEED             9   // WO, Lower byte
-#define REG_SPI_FREQ            10  // WO, Set SPI frequency
-#define REG_SLAVE_SELECT        11  // WO, Write SS
-#define REG_INT_FIRED           12  // RW
-#define REG_INT_ARMED           13  // WO
-#define REG_FIFO                14  // RW, Write to TX, Read from RX
-#define REG_IDENT               15  // RO
+#include "copy_kernels.h"
+#include "spider_regs.h"
+#include "trace.h"
+#include "bus_lock.h"
 
 #define IRQ_CD_CHANGED          PIN_CD
 #define IRQ_EXINT_CHANGED       PIN_INT
 
-#define STATUS_RX_DISCARD_EMPTY 0x01
-
 #define TEN_KHZ                 10000
 #define ONE_MHZ                 1000000
 
-#define IDENT_SIZE              8
-
 typedef void (*VOID_FUNC)();
 
 static const UBYTE ident_str[] = {0xff, 's', 'p', 'd', 'r'};
 
-#define DEFAULT_CLOCKPORT_ADDRESS   0xD80001
-#define DEFAULT_INTERRUPT_NUMBER    6
+static const char spi_lib_name[] = "spi-lib-spider";
 
-static struct ClockportConfig clockport_config = {DEFAULT_CLOCKPORT_ADDRESS,DEFAULT_INTERRUPT_NUMBER};
+struct InterruptData
+{
+    volatile UBYTE *clockport_address;
+	struct Task *task;
+	BYTE sig;		// default signal for pins without their own handler
+	UBYTE int_mask;	// pins this instance owns in REG_INT_FIRED
+	BOOL claim;		// end the server chain when our pins fired, never on VERTB
+	ULONG pin_sigs[8];				// signals sent to task per pin, by pin bit number
+	struct Interrupt *pin_ints[8];	// or soft interrupt to Cause() instead
+	// Single producer (the server), single consumer (the opening task) ring.
+	// The server only moves ev_head and the task only moves ev_tail, both run
+	// freely and wrap at 256 which SPI_EVENT_RING divides.
+	volatile UBYTE ev_head;
+	volatile UBYTE ev_tail;
+	volatile struct SpiEvent events[SPI_EVENT_RING];
+	ULONG interrupts;
+	ULONG spurious;
+	ULONG dropped;
+};
 
-static volatile BYTE *clockport_address;
+// What was last written to the board's shared registers, so unchanged values
+// are not written again. One per board, shared by the handles open on it.
+#define BOARD_KNOWN_FREQ	1
+#define BOARD_KNOWN_SELECT	2
+
+// The bus is owned by a task, not a handle, so a task can nest obtains across
+// its handles and a handle shared with the queue server is still serialised.
+struct BoardState
+{
+	UBYTE freq;			// REG_SPI_FREQ
+	UBYTE select;		// REG_SLAVE_SELECT
+	UBYTE known;		// BOARD_KNOWN_ bits of the values above that are valid
+	volatile UBYTE lock;	// bit 0 set while the bus is owned, see bus_lock.h
+	struct Task *owner;	// NULL between a release and the new owner running
+	UWORD nest;			// obtains by owner not yet released
+	UWORD selects;		// handles holding an obtain from spi_select(), see SpiController
+	UWORD waiting;		// entries in waiters
+	struct List waiters;	// BusWaiter, highest priority first. Under Forbid().
+};
+
+// On the stack of a task sleeping for the bus
+struct BusWaiter
+{
+	struct Node node;	// ln_Pri is the handle's bus priority
+	struct Task *task;
+	BOOL granted;		// the releasing task handed the lock straight over
+};
 
-static unsigned char speedMode = SPI_SPEED_SLOW;
+// One per spi_initialize() call. Allocated MEMF_PUBLIC as the interrupt server
+// reads interrupt_data through is_Data.
+struct SpiController
+{
+	struct MinNode node;
+	volatile UBYTE *clockport_address;
+	UBYTE controller;
+	UBYTE select_mask;	// value written to REG_SLAVE_SELECT to assert SS
+	UBYTE speedMode;
+	UBYTE fifo_depth;	// from caps, limits what is put in the TX ring
+	BOOL int_enabled;	// int_mask pins are armed on the board
+	BOOL speed_set;		// spi_set_speed() called since board_freq() last ran
+	BOOL select_hold;	// one of the board's obtains is from spi_select() on this handle
+	BYTE bus_pri;		// place among tasks waiting for the bus
+	LONG int_num;
+	ULONG timeout_us;	// longest a transfer may go without FIFO progress
+	ULONG byte_iters;	// poll spin iterations per byte at speedMode, 24.8 fixed point
+	struct SpiStats stats;	// interrupt counts live in interrupt_data
+	struct SpiCaps caps;
+	struct BoardState *board;
+	struct InterruptData interrupt_data;
+	struct Interrupt ports_interrupt;
+};
 
-#define CP_REG(reg)         ((volatile UBYTE *)(clockport_address + ((reg) << 2)))
-#define CP_WR(reg, val)     (*CP_REG((reg)) = (val))
-#define CP_RD(reg)          (*CP_REG((reg)))
+// All open controllers, used to tell when a board is shared
+static struct MinList open_controllers = {(struct MinNode *)&open_controllers.mlh_Tail, NULL, (struct MinNode *)&open_controllers.mlh_Head};
 
-static const char spi_lib_name[] = "spi-lib-spider";
+// Pins owned by the other handles on ctrl's board, only those armed if armed_only. Call under Forbid().
+static UBYTE board_pins(struct SpiController *ctrl, BOOL armed_only)
+{
+	struct MinNode *n = NULL;
+	struct SpiController *other = NULL;
+	UBYTE pins = 0;
+
+	for (n = open_controllers.mlh_Head; n->mln_Succ; n = n->mln_Succ){
+		other = (struct SpiController *)n;
+		if (other != ctrl && other->clockport_address == ctrl->clockport_address && (other->int_enabled || !armed_only)){
+			pins |= other->interrupt_data.int_mask;
+		}
+	}
+	return pins;
+}
 
-struct InterruptData
+// REG_INT_ARMED is shared by every handle on the board
+static void rearm_board(struct SpiController *ctrl)
 {
-    volatile UBYTE *clockport_address;
-	struct Task *task;
-	BYTE sig;
-	UBYTE lastINT;
+	UBYTE armed = 0;
+
+	Forbid();
+	armed = board_pins(ctrl, TRUE);
+	if (ctrl->int_enabled){
+		armed |= ctrl->interrupt_data.int_mask;
+	}
+	// Without it every pin interrupts, nothing to write
+	if (ctrl->caps.int_features & SPI_CAP_INT_ARMED){
+		CP_WR(ctrl->clockport_address, REG_INT_ARMED, armed);
+	}
+	Permit();
+}
+
+// Another handle on ctrl's board or NULL. Call under Forbid().
+static struct SpiController *board_peer(struct SpiController *ctrl)
+{
+	struct MinNode *n = NULL;
+
+	for (n = open_controllers.mlh_Head; n->mln_Succ; n = n->mln_Succ){
+		if ((struct SpiController *)n != ctrl && ((struct SpiController *)n)->clockport_address == ctrl->clockport_address){
+			return (struct SpiController *)n;
+		}
+	}
+	return NULL;
+}
+
+// Another handle on ctrl's board still selected by the owning task or NULL. Call under Forbid().
+static struct SpiController *board_selected(struct SpiController *ctrl)
+{
+	struct MinNode *n = NULL;
+
+	for (n = open_controllers.mlh_Head; n->mln_Succ; n = n->mln_Succ){
+		if ((struct SpiController *)n != ctrl && ((struct SpiController *)n)->board == ctrl->board &&
+			((struct SpiController *)n)->select_hold){
+			return (struct SpiController *)n;
+		}
+	}
+	return NULL;
+}
+
+static BOOL board_shared(struct SpiController *ctrl)
+{
+	return board_peer(ctrl) != NULL;
+}
+
+// Brings REG_SPI_FREQ to this handle's speed. Handles on one board share the
+// register, so it is checked again before every selection. Only a skip after
+// spi_set_speed() counts, the check on obtaining the bus never wrote before.
+static void board_freq(struct SpiController *ctrl)
+{
+	struct BoardState *bs = ctrl->board;
+	BOOL requested = ctrl->speed_set;
+
+	ctrl->speed_set = FALSE;
+	if ((bs->known & BOARD_KNOWN_FREQ) && bs->freq == ctrl->speedMode){
+		if (requested){
+			ctrl->stats.writes_skipped++;
+		}
+		return;
+	}
+	CP_WR(ctrl->clockport_address, REG_SPI_FREQ, ctrl->speedMode);
+	bs->freq = ctrl->speedMode;
+	bs->known |= BOARD_KNOWN_FREQ;
+}
+
+static void board_select(struct SpiController *ctrl, UBYTE select)
+{
+	struct BoardState *bs = ctrl->board;
+
+	if ((bs->known & BOARD_KNOWN_SELECT) && bs->select == select){
+		ctrl->stats.writes_skipped++;
+		return;
+	}
+	CP_WR(ctrl->clockport_address, REG_SLAVE_SELECT, select);
+	bs->select = select;
+	bs->known |= BOARD_KNOWN_SELECT;
+}
+
+// Sleeps until w is handed the lock or finds it free at the head of the queue.
+// Call under Forbid() with w queued, the Wait() lets the owner run.
+static void bus_wait(struct BoardState *bs, struct BusWaiter *w)
+{
+	while (!w->granted && ((struct BusWaiter *)bs->waiters.lh_Head != w || !bus_try_lock(&bs->lock))){
+		SetSignal(0, SIGF_SINGLE);
+		Wait(SIGF_SINGLE);
+	}
+	Remove(&w->node);
+	bs->waiting--;
+}
+
+static void bus_queue(struct SpiController *ctrl, struct BusWaiter *w, struct Task *me)
+{
+	w->node.ln_Pri = ctrl->bus_pri;
+	w->node.ln_Name = NULL;
+	w->task = me;
+	w->granted = FALSE;
+	Enqueue(&ctrl->board->waiters, &w->node);
+	ctrl->board->waiting++;
+}
+
+void spi_obtain_bus(struct SpiController *ctrl)
+{
+	struct BoardState *bs = ctrl->board;
+	struct Task *me = FindTask(NULL);
+	struct BusWaiter w;
+	ULONG start = 0, waited = 0;
+
+	if (bs->owner == me){
+		bs->nest++;
+	}else{
+		// The BSET only while nobody queues, or it would jump ahead of them
+		if (bs->waiting || !bus_try_lock(&bs->lock)){
+			start = timer_micros();
+			Forbid();
+			bus_queue(ctrl, &w, me);
+			bus_wait(bs, &w);
+			Permit();
+
+			waited = timer_micros() - start;
+			ctrl->stats.bus_waits++;
+			ctrl->stats.bus_wait_us += waited;
+			if (waited > ctrl->stats.bus_wait_max_us){
+				ctrl->stats.bus_wait_max_us = waited;
+			}
+		}
+		bs->owner = me;
+		bs->nest = 1;
+	}
+	// Another handle may have left the board at its own speed
+	board_freq(ctrl);
+}
+
+BOOL spi_attempt_bus(struct SpiController *ctrl)
+{
+	struct BoardState *bs = ctrl->board;
+	struct Task *me = FindTask(NULL);
+
+	if (bs->owner == me){
+		bs->nest++;
+	}else if (!bs->waiting && bus_try_lock(&bs->lock)){
+		bs->owner = me;
+		bs->nest = 1;
+	}else{
+		return FALSE;
+	}
+	board_freq(ctrl);
+	return TRUE;
+}
+
+void spi_release_bus(struct SpiController *ctrl)
+{
+	struct BoardState *bs = ctrl->board;
+	struct BusWaiter *w = NULL;
+
+	if (bs->owner != FindTask(NULL) || --bs->nest){
+		return;
+	}
+	bs->owner = NULL;
+	bus_unlock(&bs->lock);
+
+	// A waiter queued after the test above finds the lock free itself
+	if (bs->waiting){
+		Forbid();
+		// Taken back to give it to the first waiter, unless a task got in
+		// first, in which case its release does this
+		if (bs->waiting && bus_try_lock(&bs->lock)){
+			w = (struct BusWaiter *)bs->waiters.lh_Head;
+			w->granted = TRUE;
+			Signal(w->task, SIGF_SINGLE);
+		}
+		Permit();
+	}
+}
+
+BOOL spi_bus_contended(struct SpiController *ctrl)
+{
+	struct BoardState *bs = ctrl->board;
+	BOOL wanted = FALSE;
+
+	if (bs->waiting){
+		Forbid();
+		wanted = bs->waiting && ((struct BusWaiter *)bs->waiters.lh_Head)->node.ln_Pri >= ctrl->bus_pri;
+		Permit();
+	}
+	return wanted;
+}
+
+BOOL spi_yield_bus(struct SpiController *ctrl)
+{
+	struct BoardState *bs = ctrl->board;
+	struct Task *me = FindTask(NULL);
+	struct BusWaiter w;
+	UWORD nest = 0;
+
+	if (bs->owner != me || bs->selects || !spi_bus_contended(ctrl)){
+		return FALSE;
+	}
+
+	Forbid();
+	// Queued behind the waiter first, Enqueue() puts equal priorities in
+	// arrival order, so the release hands the bus to it and not back here
+	nest = bs->nest;
+	bs->nest = 1;
+	bus_queue(ctrl, &w, me);
+	spi_release_bus(ctrl);
+	bus_wait(bs, &w);
+	Permit();
+
+	bs->owner = me;
+	bs->nest = nest;
+	ctrl->stats.bus_yields++;
+	board_freq(ctrl);
+	return TRUE;
+}
+
+void spi_set_bus_priority(struct SpiController *ctrl, BYTE pri)
+{
+	ctrl->bus_pri = pri;
+}
+
+// Rate aware polling. Every head/tail read is a slow clockport cycle, so after
+// a poll the CPU spins locally for roughly the time the bus needs to move the
+// bytes worth coming back for. byte_iters is learned from how many bytes the
+// poll after a spin finds: too few and the spin grows, well over what was
+// expected or a full ring (bus may have stalled) and it shrinks. The first
+// poll of a run follows no spin and is not used. The first spi_set_speed()
+// seeds it from the measured spin rate and the byte time, later ones rescale
+// it for the new byte time.
+#define POLL_BURST			64		// bytes worth waiting for before polling again
+#define POLL_RING_FULL		240		// poll found the ring (nearly) full or empty
+#define POLL_ITERS_MAX		(1UL << 24)
+#define POLL_LEARN_MIN		16		// fewest expected bytes a poll learns from
+#define SPIN_PROBE_ITERS	4096	// spins timed to find the spin rate
+#define SPIN_PROBE_RUNS		3		// shortest run is kept, interrupts only add time
+
+static ULONG spin_per_ms;			// CPU_SPIN() iterations per millisecond, 0 until measured
+
+// Needs the microsecond clock open
+static ULONG spin_rate(void)
+{
+	ULONG t = 0, best = 0xFFFFFFFF;
+	int i = 0;
+
+	if (!spin_per_ms){
+		for (; i < SPIN_PROBE_RUNS; i++){
+			t = timer_micros();
+			CPU_SPIN(SPIN_PROBE_ITERS);
+			t = timer_micros() - t;
+			if (t < best){
+				best = t;
+			}
+		}
+		spin_per_ms = SPIN_PROBE_ITERS * 1000UL / (best ? best : 1);
+	}
+	return spin_per_ms;
+}
+
+static void poll_wait(struct SpiController *ctrl, UWORD *expect, UBYTE got, UWORD remaining)
+{
+	UWORD wanted = remaining < POLL_BURST ? remaining : POLL_BURST;
+
+	ctrl->stats.polls++;
+	ctrl->stats.poll_bytes += got;
+
+	// A spin for the last few bytes is mostly overshoot, learn from longer ones
+	if (*expect >= POLL_LEARN_MIN){
+		if (got >= POLL_RING_FULL || got > *expect + (*expect >> 1)){
+			ctrl->byte_iters -= ctrl->byte_iters >> 2;
+		}else if (got < *expect && ctrl->byte_iters < POLL_ITERS_MAX){
+			ctrl->byte_iters += (ctrl->byte_iters >> 3) + 1;
+		}
+	}
+
+	*expect = wanted;
+	if (remaining){
+		ctrl->stats.spins++;
+		CPU_SPIN((ctrl->byte_iters * wanted) >> 8);
+	}
+}
+
+static ULONG speed_khz(UBYTE speed)
+{
+	return (speed & 0x80) ? (ULONG)(speed & 0x7F) * 1000 : speed;
+}
+
+// Stall deadline. The clock is only read when a poll makes no progress and is
+// armed from the first such poll, so the timeout does not depend on CPU
+// speed, bus speed or transfer length.
+struct Stall
+{
+	ULONG deadline;
+	BOOL armed;
 };
 
+static BOOL stall_expired(struct SpiController *ctrl, struct Stall *st)
+{
+	ULONG now = timer_micros();
+
+	if (!st->armed){
+		st->deadline = now + ctrl->timeout_us;
+		st->armed = TRUE;
+		return FALSE;
+	}
+	return (LONG)(now - st->deadline) >= 0;
+}
+
 // 26-Aug-25 Aidan Holmes change to implement in C code and trigger signal
-static void __interrupt __saveds __asm SPI_Interrupt(register __a1 struct InterruptData* dat, register __a6 APTR _card_Code)
+// Servers on PORTS and EXTER share the line with other hardware and VERTB
+// runs at 50 Hz whatever SPIder does, so most calls are not for us. Those
+// cost one clockport read and leave the chain with Z set. __interrupt has
+// the return value tested on exit.
+static ULONG __interrupt __saveds __asm SPI_Interrupt(register __a1 struct InterruptData* dat, register __a6 APTR _card_Code)
 {
 	// DO NOT PRINT TO STDOUT IN INTERRUPT - SERIAL IS OK
-	// Capture what fired then reset interrupt immediately
-	dat->lastINT = CP_RD(REG_INT_FIRED);
-	CP_WR(REG_INT_FIRED, 0);
-	
-	Signal(dat->task, 1 << dat->sig);
+	volatile UBYTE *cp = dat->clockport_address;
+	volatile struct SpiEvent *ev = NULL;
+	UBYTE fired = CP_RD(cp, REG_INT_FIRED);
+	UBYTE pins = fired & dat->int_mask, p = 0, i = 0;
+	ULONG sigs = 0;
+
+	if (!pins){
+		dat->spurious++;
+		return 0;
+	}
+	TRACE(TRACE_INTERRUPT, fired, pins);
+
+	// Several instances can share a board, only take and clear our own pins
+	CP_WR(cp, REG_INT_FIRED, fired & ~dat->int_mask);
+	dat->interrupts++;
+	if ((UBYTE)(dat->ev_head - dat->ev_tail) < SPI_EVENT_RING){
+		ev = &dat->events[dat->ev_head & (SPI_EVENT_RING - 1)];
+		ev->micros = timer_micros();
+		ev->pins = pins;
+		ev->gpios = CP_RD(cp, REG_GPIOS);
+		// Publish only once the slot is filled in
+		dat->ev_head++;
+	}else{
+		dat->dropped++;
+	}
+
+	for (p = pins; p; p >>= 1, i++){
+		if (p & 1){
+			if (dat->pin_ints[i]){
+				Cause(dat->pin_ints[i]);
+			}else{
+				sigs |= dat->pin_sigs[i];
+			}
+		}
+	}
+	if (sigs){
+		Signal(dat->task, sigs);
+	}
+
+	// Other handles on the board may still have pins pending
+	return dat->claim && !(fired & ~dat->int_mask);
+}
+
+void spi_diag(struct SpiController *ctrl)
+{
+	struct SpiStats st;
+#ifdef _DEBUG
+	volatile UBYTE *cp = ctrl->clockport_address;
+	UBYTE intmask = CP_RD(cp, REG_GPIOS);
+
+	DebugPrint(DEBUG_LEVEL, "Controller %u: REG_INT_FIRED 0x%02X, EXTERNAL INT %d, CARD DETECT %d\n", ctrl->controller, CP_RD(cp, REG_INT_FIRED), (intmask & PIN_INT)?1:0, (intmask & PIN_CD)?1:0);
+#endif
+
+	DebugPrint(INFO_LEVEL, "Controller %u: firmware %u.%u.%u, FIFO %u, speed code %u of max %u\n", ctrl->controller,
+		ctrl->caps.fw_major, ctrl->caps.fw_minor, ctrl->caps.fw_patch, ctrl->caps.fifo_depth, ctrl->speedMode, ctrl->caps.max_speed);
+
+	// Statistics are always kept, print them in release builds too
+	spi_get_stats(ctrl, &st);
+	DebugPrint(INFO_LEVEL, "Controller %u: read %lu, written %lu bytes, %lu timeouts\n", ctrl->controller, st.bytes_read, st.bytes_written, st.timeouts);
+	DebugPrint(INFO_LEVEL, "Controller %u: transfers 1-15 %lu, 16-63 %lu, 64-255 %lu, 256-1023 %lu, 1024-4095 %lu, 4096+ %lu\n", ctrl->controller,
+		st.transfers[0], st.transfers[1], st.transfers[2], st.transfers[3], st.transfers[4], st.transfers[5]);
+	DebugPrint(INFO_LEVEL, "Controller %u: %lu polls for %lu bytes, %lu spins of %lu/256 per byte, FIFO full %lu, empty %lu\n", ctrl->controller,
+		st.polls, st.poll_bytes, st.spins, ctrl->byte_iters, st.fifo_full, st.fifo_empty);
+	DebugPrint(INFO_LEVEL, "Controller %u: %lu interrupts, %lu spurious, %lu events dropped\n", ctrl->controller, st.interrupts, st.spurious_interrupts, st.events_dropped);
+	DebugPrint(INFO_LEVEL, "Controller %u: %lu unchanged speed and select writes skipped\n", ctrl->controller, st.writes_skipped);
+	DebugPrint(INFO_LEVEL, "Controller %u: waited for the bus %lu times, %lu us in all, longest %lu us, yielded %lu times\n", ctrl->controller,
+		st.bus_waits, st.bus_wait_us, st.bus_wait_max_us, st.bus_yields);
 }
 
-static struct InterruptData interrupt_data;
-static struct Interrupt ports_interrupt;
+void spi_get_stats(struct SpiController *ctrl, struct SpiStats *stats)
+{
+	*stats = ctrl->stats;
+	stats->interrupts = ctrl->interrupt_data.interrupts;
+	stats->spurious_interrupts = ctrl->interrupt_data.spurious;
+	stats->events_dropped = ctrl->interrupt_data.dropped;
+}
 
-void spi_diag(void)
+void spi_reset_stats(struct SpiController *ctrl)
 {
-	UBYTE intmask = CP_RD(REG_GPIOS);
-	D(DebugPrint(DEBUG_LEVEL, "REG_INT_FIRED 0x%02X, EXTERNAL INT %d, CARD DETECT %d\n", CP_RD(REG_INT_FIRED), (intmask & PIN_INT)?1:0, (intmask & PIN_CD)?1:0));
+	memset(&ctrl->stats, 0, sizeof(struct SpiStats));
+
+	Disable();
+	ctrl->interrupt_data.interrupts = 0;
+	ctrl->interrupt_data.spurious = 0;
+	ctrl->interrupt_data.dropped = 0;
+	Enable();
 }
 
-__inline void spider_usr_reset(int val)
+__inline void spider_usr_reset(struct SpiController *ctrl, int val)
 {
-	CP_WR(REG_RESET, (val > 0)?1:0);
+	CP_WR(ctrl->clockport_address, REG_RESET, (val > 0)?1:0);
 }
 
-__inline void spi_select(void)
+__inline void spi_select(struct SpiController *ctrl)
 {
-    CP_WR(REG_SLAVE_SELECT, 1);
+	struct BoardState *bs = ctrl->board;
+
+	TRACE(TRACE_SELECT, ctrl->select_mask, ctrl->controller);
+	// The bus stays owned until spi_deselect(), selecting again holds it once.
+	// The hold is per handle, one task may select through several of a board's
+	// handles, the last one selected drives SS.
+	spi_obtain_bus(ctrl);
+	if (ctrl->select_hold){
+		bs->nest--;
+	}else{
+		ctrl->select_hold = TRUE;
+		bs->selects++;
+	}
+	board_select(ctrl, ctrl->select_mask);
 }
 
-__inline void spi_deselect(void)
+__inline void spi_deselect(struct SpiController *ctrl)
 {
-    CP_WR(REG_SLAVE_SELECT, 0);
+	struct BoardState *bs = ctrl->board;
+	struct SpiController *other = NULL;
+	BOOL held = ctrl->select_hold;
+
+	TRACE(TRACE_DESELECT, 0, ctrl->controller);
+	// Owned for the write too, another task may be in a transaction
+	spi_obtain_bus(ctrl);
+	if (held){
+		ctrl->select_hold = FALSE;
+		bs->selects--;
+	}
+	// Back to a handle this task still has selected, if any
+	if (bs->selects){
+		Forbid();
+		other = board_selected(ctrl);
+		Permit();
+	}
+	board_select(ctrl, other ? other->select_mask : 0);
+	if (held){
+		spi_release_bus(ctrl);
+	}
+	spi_release_bus(ctrl);
 }
 
-__inline int spi_pin_val(unsigned char pin)
+__inline int spi_pin_val(struct SpiController *ctrl, unsigned char pin)
 {
-	return (CP_RD(REG_GPIOS) & pin)?1:0;
+	return (CP_RD(ctrl->clockport_address, REG_GPIOS) & pin)?1:0;
 }
 
-__inline void spi_enable_interrupt(void)
+void spi_enable_interrupt(struct SpiController *ctrl)
 {
-	CP_WR(REG_INT_ARMED, 0xFF);
+	ctrl->int_enabled = TRUE;
+	rearm_board(ctrl);
 }
 
-__inline void spi_disable_interrupt(void)
+void spi_disable_interrupt(struct SpiController *ctrl)
 {
-	CP_WR(REG_INT_ARMED, 0);
+	ctrl->int_enabled = FALSE;
+	rearm_board(ctrl);
 }
 
-__inline unsigned char spi_reset_interrupt(void)
+void spi_arm_pins(struct SpiController *ctrl, UBYTE pins)
+{
+	ctrl->interrupt_data.int_mask = pins;
+	rearm_board(ctrl);
+}
+
+void spi_set_pin_handler(struct SpiController *ctrl, UBYTE pins, BYTE sig, struct Interrupt *softint)
+{
+	struct InterruptData *dat = &ctrl->interrupt_data;
+	ULONG sigmask = 0;
+	UBYTE i = 0;
+
+	if (!softint){
+		if (sig < 0){
+			sig = dat->sig;
+		}
+		sigmask = sig < 0 ? 0 : 1UL << sig;
+	}
+
+	Disable();
+	for (; pins; pins >>= 1, i++){
+		if (pins & 1){
+			dat->pin_ints[i] = softint;
+			dat->pin_sigs[i] = sigmask;
+		}
+	}
+	Enable();
+}
+
+int spi_get_events(struct SpiController *ctrl, struct SpiEvent *events, int max)
+{
+	struct InterruptData *dat = &ctrl->interrupt_data;
+	UBYTE head = dat->ev_head, tail = dat->ev_tail;
+	int n = 0;
+
+	while (tail != head && n < max){
+		events[n++] = dat->events[tail & (SPI_EVENT_RING - 1)];
+		tail++;
+	}
+	// Hand the slots back only after they have been copied
+	dat->ev_tail = tail;
+
+	return n;
+}
+
+unsigned char spi_reset_interrupt(struct SpiController *ctrl)
 {	
-	D(DebugPrint(DEBUG_LEVEL,"spi_reset_interrupt: interrupt val 0x%02X\n", interrupt_data.lastINT));
+	volatile UBYTE *cp = ctrl->clockport_address;
+	struct InterruptData *dat = &ctrl->interrupt_data;
+	struct SpiEvent ev;
+	UBYTE pins = 0;
+
+	while (spi_get_events(ctrl, &ev, 1)){
+		pins |= ev.pins;
+	}
+
+	D(DebugPrint(DEBUG_LEVEL,"spi_reset_interrupt: interrupt val 0x%02X\n", pins));
 
     // Re-enable the CD changed interrupt.
-	//CP_WR(REG_INT_ARMED, IRQ_EXINT_CHANGED | IRQ_CD_CHANGED);
+	//CP_WR(cp, REG_INT_ARMED, IRQ_EXINT_CHANGED | IRQ_CD_CHANGED);
 	
-	CP_WR(REG_INT_FIRED, 0);
+	CP_WR(cp, REG_INT_FIRED, CP_RD(cp, REG_INT_FIRED) & ~dat->int_mask);
 
-    return interrupt_data.lastINT;
+    return pins;
 }
 
-void spi_set_speed(unsigned char speed)
+// Next supported encoding at or below speed, MHz codes first then kHz
+static UBYTE supported_speed(const struct SpiCaps *caps, UBYTE speed)
 {
-    //UBYTE freq = speed == SPI_SPEED_FAST ? (128 + 16) : 40;
-	speedMode = speed ;
-    CP_WR(REG_SPI_FREQ, speed);
+	if (speed == SPI_SPEED_MAX){
+		return caps->max_speed;
+	}
+	for (; speed > SPI_MHZ(0) && !SPI_CAP_SPEED(caps, speed); speed--){
+	}
+	if (speed == SPI_MHZ(0)){
+		speed = SPI_KHZ(127);
+	}
+	for (; speed > 0 && !SPI_CAP_SPEED(caps, speed); speed--){
+	}
+	return speed ? speed : caps->max_speed;
 }
 
-// These two assembly functions were contributed by Patrik Axelsson.
-extern void __asm copy_from_reg(register __a0 UBYTE *dst, register __a1 volatile UBYTE *reg, register __d0 WORD length);
-extern void __asm copy_to_reg(register __a0 volatile UBYTE *reg, register __a1 const UBYTE *src, register __d0 WORD length);
+// Fastest supported encoding at or below hz, the slowest if hz is below them all
+static UBYTE speed_for_hz(const struct SpiCaps *caps, ULONG hz)
+{
+	UBYTE speed = 0;
+
+	// SPI_MHZ() and SPI_KHZ() do not bracket their argument
+	if (hz >= ONE_MHZ){
+		speed = hz >= 127UL * ONE_MHZ ? 127 : hz / ONE_MHZ;
+		speed = SPI_MHZ(speed);
+	}else if (hz >= 127000UL){
+		speed = SPI_KHZ(127);
+	}else{
+		speed = hz >= 1000 ? hz / 1000 : 1;
+	}
+	speed = supported_speed(caps, speed);
+	if (!SPI_CAP_SPEED(caps, speed)){
+		for (speed = SPI_KHZ(1); !SPI_CAP_SPEED(caps, speed) && speed != caps->max_speed; speed++){
+		}
+	}
+	return speed;
+}
 
-void __asm copy_from_reg2(register __a0 UBYTE *dst, register __a1 volatile UBYTE *reg, register __d0 WORD length)
+// Next faster supported encoding, or speed itself at the top. Encodings
+// order the same way as their frequencies.
+static UBYTE speed_up(const struct SpiCaps *caps, UBYTE speed)
 {
-	WORD i = 0;
-	for (;i < length;i++){
-		*dst++ = *reg;
+	UBYTE next = speed;
+
+	while (next < caps->max_speed){
+		next++;
+		if (SPI_CAP_SPEED(caps, next)){
+			return next;
+		}
 	}
+	return speed;
 }
 
-void __asm copy_to_reg2(register __a0 volatile UBYTE *reg, register __a1 const UBYTE *src, register __d0 WORD length)
+ULONG spi_set_frequency(struct SpiController *ctrl, ULONG hz)
 {
-	WORD i = 0;
-	for (;i < length;i++){
-		*reg = *src++;
+	spi_set_speed(ctrl, speed_for_hz(&ctrl->caps, hz));
+	return spi_get_frequency(ctrl);
+}
+
+ULONG spi_get_frequency(struct SpiController *ctrl)
+{
+	return speed_khz(ctrl->speedMode) * 1000;
+}
+
+void spi_set_speed(struct SpiController *ctrl, unsigned char speed)
+{
+    //UBYTE freq = speed == SPI_SPEED_FAST ? (128 + 16) : 40;
+	ULONG old_khz = 0, new_khz = 0;
+
+	speed = supported_speed(&ctrl->caps, speed);
+	old_khz = speed_khz(ctrl->speedMode);
+	new_khz = speed_khz(speed);
+
+	// Keep the learned poll spin, scaled to the new byte time. A byte takes
+	// 8000 / khz us, which is spin_per_ms * 8 / khz spins, in 24.8 fixed point.
+	if (!old_khz && new_khz){
+		ctrl->byte_iters = spin_rate() * 2048UL / new_khz;
+		if (ctrl->byte_iters > POLL_ITERS_MAX){
+			ctrl->byte_iters = POLL_ITERS_MAX;
+		}
+	}else if (old_khz && new_khz){
+		if (old_khz > new_khz){
+			if (ctrl->byte_iters > POLL_ITERS_MAX / (old_khz / new_khz)){
+				ctrl->byte_iters = POLL_ITERS_MAX;
+			}else{
+				ctrl->byte_iters *= old_khz / new_khz;
+			}
+		}else{
+			ctrl->byte_iters /= new_khz / old_khz;
+		}
+	}
+	ctrl->speedMode = speed ;
+	ctrl->speed_set = TRUE;
+	// Otherwise written when the bus is next obtained
+	if (ctrl->board->owner == FindTask(NULL)){
+		board_freq(ctrl);
 	}
 }
 
+void spi_device_init(struct SpiController *ctrl, struct SpiDevice *dev, ULONG hz, UBYTE select_mask, ULONG timeout_ms)
+{
+	dev->speed = speed_for_hz(&ctrl->caps, hz);
+	dev->select_mask = select_mask ? select_mask : 1 << ctrl->controller;
+	dev->reserved = 0;
+	dev->timeout_ms = timeout_ms;
+}
 
-void  __asm __saveds spi_read(register __a0 UBYTE *buf, register __d0 WORD size)
+void spi_use_device(struct SpiController *ctrl, struct SpiDevice *dev)
 {
-	volatile UBYTE *fifo = NULL;
-	UBYTE rx_head =0, bytes_in_rx =0, rx_tail =0;
-	UWORD retry = 50000;
+	// Only a speed the board is not already at is written
+	spi_set_speed(ctrl, dev->speed);
+	ctrl->select_mask = dev->select_mask;
+	if (dev->timeout_ms){
+		spi_set_timeout(ctrl, dev->timeout_ms);
+	}
+}
 
-    CP_WR(REG_UPPER_LENGTH, size >> 8);
-    CP_WR(REG_TX_FEED, size & 0xff);
+static void count_transfer(struct SpiController *ctrl, ULONG length)
+{
+	UBYTE bucket = 0;
 
-    fifo = CP_REG(REG_FIFO);
+	for (length >>= 4; length && bucket < SPI_SIZE_BUCKETS - 1; length >>= 2){
+		bucket++;
+	}
+	ctrl->stats.transfers[bucket]++;
+}
 
-    rx_head = CP_RD(REG_RX_HEAD);
+#ifndef AFF_68060
+#define AFF_68060	(1L << 7)	// Not in older NDKs, set by 68060.library
+#endif
 
-    if (size == 1)
-    {
-        do
-        {
-            rx_tail = CP_RD(REG_RX_TAIL);
+// FIFO copy kernels, replaced with the best variant for the CPU by spi_initialize()
+static COPY_FROM_FUNC copy_from_reg = copy_from_fifo_000;
+static COPY_TO_FUNC copy_to_reg = copy_to_fifo_000;
+
+static void select_copy_kernels(void)
+{
+	UWORD attn = SysBase->AttnFlags;
+
+	if (attn & (AFF_68040 | AFF_68060)){
+		copy_from_reg = copy_from_fifo_040;
+		copy_to_reg = copy_to_fifo_040;
+	}else if (attn & (AFF_68020 | AFF_68030)){
+		copy_from_reg = copy_from_fifo_020;
+		copy_to_reg = copy_to_fifo_020;
+	}else{
+		copy_from_reg = copy_from_fifo_000;
+		copy_to_reg = copy_to_fifo_000;
+	}
+}
+
+// Reads a run of READ/DUMMY segments covered by one TX_FEED length of total bytes
+static LONG fifo_read_run(struct SpiController *ctrl, const struct SpiSegment *seg, UWORD total)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	volatile UBYTE *fifo = CP_REG(cp, REG_FIFO);
+	UBYTE *dst = seg->rx;
+	UWORD seg_left = seg->length;
+	UBYTE rx_head =0, bytes_in_rx =0, rx_tail =0, chunk =0, got =0;
+	UWORD expect = 0;
+	struct Stall st = {0, FALSE};
+
+    CP_WR(cp, REG_UPPER_LENGTH, total >> 8);
+    CP_WR(cp, REG_TX_FEED, total & 0xff);
+
+    rx_head = CP_RD(cp, REG_RX_HEAD);
+
+    do{
+        rx_tail = CP_RD(cp, REG_RX_TAIL);
+
+        bytes_in_rx = rx_tail - rx_head;
+		
+		//D(DebugPrint(DEBUG_LEVEL,"fifo_read_run: Bytes in RX %u, head %u, tail %u, remaining to read %u\n", bytes_in_rx, rx_head, rx_tail, total));
+
+        got = bytes_in_rx;
+        rx_head += bytes_in_rx;
+        total -= bytes_in_rx;
+        ctrl->stats.bytes_read += bytes_in_rx;
+        if (!got){
+            ctrl->stats.fifo_empty++;
+        }else if (got == ctrl->fifo_depth){
+            ctrl->stats.fifo_full++;
         }
-        while (rx_head == rx_tail);
+        while (bytes_in_rx){
+            while (seg_left == 0){
+                seg++;
+                dst = seg->rx;
+                seg_left = seg->length;
+            }
+            chunk = bytes_in_rx;
+            if (chunk > seg_left){
+                chunk = seg_left;
+			}
 
-        *buf = *fifo;
-    }
-    else
-    {
-        do
-        {
-            rx_tail = CP_RD(REG_RX_TAIL);
+            if (seg->type == SPI_SEG_DUMMY){
+                while (chunk--){
+                    FIFO_RD(fifo);
+                    seg_left--;
+                    bytes_in_rx--;
+                }
+                continue;
+            }
+            copy_from_reg(dst, fifo, chunk);
+            dst += chunk;
+            seg_left -= chunk;
+            bytes_in_rx -= chunk;
+        }
+        poll_wait(ctrl, &expect, got, total);
+		if (got){
+			st.armed = FALSE;
+		}else if (stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi read: Failed! - head %u, tail %u, remaining to read %u\n", rx_head, rx_tail, total);
+			return SPI_ERR_TIMEOUT;
+		}
+    }while (total);
+
+	return SPI_OK;
+}
+
+// Writes a run of WRITE segments covered by one RX_DISCARD length of total bytes.
+// Returns once the last byte is in the TX ring, use fifo_discard_wait() for the bus to finish.
+static LONG fifo_write_run(struct SpiController *ctrl, const struct SpiSegment *seg, UWORD total)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	volatile UBYTE *fifo = CP_REG(cp, REG_FIFO);
+	const UBYTE *src = seg->tx;
+	UWORD seg_left = seg->length;
+	UBYTE tx_head =0, tx_tail =0, bytes_in_tx =0, free_space =0, chunk =0, got =0;
+	UWORD expect = 0;
+	struct Stall st = {0, FALSE};
+	
+    CP_WR(cp, REG_UPPER_LENGTH, total >> 8);
+    CP_WR(cp, REG_RX_DISCARD, total & 0xff);
+
+    tx_tail = CP_RD(cp, REG_TX_TAIL);
+
+    do{
+        tx_head = CP_RD(cp, REG_TX_HEAD);
 
-            bytes_in_rx = rx_tail - rx_head;
+        bytes_in_tx = tx_tail - tx_head;
+        free_space = ctrl->fifo_depth - bytes_in_tx;
 			
-			//D(DebugPrint(DEBUG_LEVEL,"spi_read: Bytes in RX %u, head %u, tail %u, remaining to read %u\n", bytes_in_rx, rx_head, rx_tail, size));
+		//D(DebugPrint(DEBUG_LEVEL,"fifo_write_run: Bytes free in TX %u, head %u, tail %u, remaining to write %u\n", free_space, tx_head, tx_tail, total));
 
-            if (bytes_in_rx)
-            {
-                copy_from_reg(buf, fifo, bytes_in_rx);
-                buf += bytes_in_rx;
-                rx_head += bytes_in_rx;
-                size -= bytes_in_rx;
+        got = free_space;
+        if (!got){
+            ctrl->stats.fifo_full++;
+        }else if (got == ctrl->fifo_depth && expect){
+            ctrl->stats.fifo_empty++;
+        }
+        if (free_space > total){
+            free_space = total;
+		}
+        tx_tail += free_space;
+        total -= free_space;
+        ctrl->stats.bytes_written += free_space;
+        while (free_space){
+            while (seg_left == 0){
+                seg++;
+                src = seg->tx;
+                seg_left = seg->length;
             }
-			if (--retry == 0){
-				DebugPrint(DEBUG_LEVEL,"spi_read: Failed! - Bytes in RX %u, head %u, tail %u, remaining to read %u\n", bytes_in_rx, rx_head, rx_tail, size);
-				break;
+            chunk = free_space;
+            if (chunk > seg_left){
+                chunk = seg_left;
 			}
+
+            copy_to_reg(fifo, src, chunk);
+            src += chunk;
+            seg_left -= chunk;
+            free_space -= chunk;
         }
-        while (size);
-    }
+        poll_wait(ctrl, &expect, got, total);
+		if (got){
+			st.armed = FALSE;
+		}else if (stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi write: Failed! - head %u, tail %u, remaining to write %u\n", tx_head, tx_tail, total);
+			return SPI_ERR_TIMEOUT;
+		}
+    }while (total);
+
+	return SPI_OK;
 }
 
-void  __asm __saveds spi_write(register __a0 const UBYTE *buf, register __d0 WORD size)
+// Wait for the firmware to clock out everything queued by fifo_write_run()
+static LONG fifo_discard_wait(struct SpiController *ctrl)
 {
-	volatile BYTE *fifo = NULL;
-	UBYTE tx_head =0, tx_tail =0, next_tx_tail=0, bytes_in_tx =0, free_space =0;
-	UWORD retry = 50000;
-	
-    CP_WR(REG_UPPER_LENGTH, size >> 8);
-    CP_WR(REG_RX_DISCARD, size & 0xff);
+	volatile UBYTE *cp = ctrl->clockport_address;
+	struct Stall st = {0, FALSE};
+	UBYTE polls = 0;
+
+	while((CP_RD(cp, REG_STATUS) & STATUS_RX_DISCARD_EMPTY) == 0){
+		// At most a ring's worth is left, look again a quarter of a byte time
+		// later and only at the clock now and then
+		CPU_SPIN(ctrl->byte_iters >> 10);
+		if ((++polls & 0x0F) == 0 && stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi write: Failed! - Status 0x%02X\n", CP_RD(cp, REG_STATUS));
+			return SPI_ERR_TIMEOUT;
+		}
+	}
+	return SPI_OK;
+}
 
-    fifo = CP_REG(REG_FIFO);
+// Cancel whatever the firmware still has queued and empty the RX ring, so
+// stale bytes are not returned by the next transfer
+static void fifo_reset(struct SpiController *ctrl)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	UBYTE bytes_in_rx = 0;
 
-    tx_tail = CP_RD(REG_TX_TAIL);
+	CP_WR(cp, REG_UPPER_LENGTH, 0);
+	CP_WR(cp, REG_TX_FEED, 0);
+	CP_WR(cp, REG_UPPER_LENGTH, 0);
+	CP_WR(cp, REG_RX_DISCARD, 0);
 
-    if (size == 1){
-        next_tx_tail = tx_tail + 1;
-        do{
-            tx_head = CP_RD(REG_TX_HEAD);
-        }while (next_tx_tail == tx_head);
+	bytes_in_rx = CP_RD(cp, REG_RX_TAIL) - CP_RD(cp, REG_RX_HEAD);
+	while (bytes_in_rx--){
+		CP_RD(cp, REG_FIFO);
+	}
+}
 
-        *fifo = *buf;
-    }else{
-        do{
-            tx_head = CP_RD(REG_TX_HEAD);
+// After a timeout
+static void fifo_abort(struct SpiController *ctrl)
+{
+	ctrl->stats.timeouts++;
+	fifo_reset(ctrl);
+}
 
-            bytes_in_tx = tx_tail - tx_head;
-            free_space = 255 - bytes_in_tx;
-			
-			//D(DebugPrint(DEBUG_LEVEL,"spi_write: Bytes free in TX %u, head %u, tail %u, remaining to write %u\n", free_space, tx_head, tx_tail, size));
+// Full duplex - no feed or discard length is programmed so every byte sent comes
+// from the TX ring and every byte received lands in the RX ring.
+static LONG fifo_transfer(struct SpiController *ctrl, const UBYTE *tx, UBYTE *rx, UWORD size)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	volatile UBYTE *fifo = CP_REG(cp, REG_FIFO);
+	UBYTE rx_head =0, rx_tail =0, bytes_in_rx =0, in_flight =0, free_space =0;
+	UWORD to_send = size, expect = 0;
+	struct Stall st = {0, FALSE};
+
+    rx_head = CP_RD(cp, REG_RX_HEAD);
+
+    do{
+		// Bytes written but not yet read back are either waiting in the TX ring,
+		// in the shifter or sitting in the RX ring. Capping them at the ring
+		// depth means neither can overflow, so only RX_TAIL needs polling.
+		free_space = ctrl->fifo_depth - in_flight;
+		if (free_space > to_send){
+			free_space = to_send;
+		}
 
-            if (free_space){
-                if (free_space > size){
-                    free_space = size;
-				}
+		if (free_space){
+			copy_to_reg(fifo, tx, free_space);
+			tx += free_space;
+			to_send -= free_space;
+			in_flight += free_space;
+			ctrl->stats.bytes_written += free_space;
+		}
+
+        rx_tail = CP_RD(cp, REG_RX_TAIL);
 
-                copy_to_reg(fifo, buf, free_space);
-                buf += free_space;
-                tx_tail += free_space;
-                size -= free_space;
+        bytes_in_rx = rx_tail - rx_head;
+
+        if (bytes_in_rx){
+            copy_from_reg(rx, fifo, bytes_in_rx);
+            rx += bytes_in_rx;
+            rx_head += bytes_in_rx;
+            in_flight -= bytes_in_rx;
+            size -= bytes_in_rx;
+            ctrl->stats.bytes_read += bytes_in_rx;
+            if (bytes_in_rx == ctrl->fifo_depth){
+                ctrl->stats.fifo_full++;
             }
-			if (--retry == 0){
-				DebugPrint(DEBUG_LEVEL,"spi_write: Failed! - Bytes free in TX %u, head %u, tail %u, remaining to write %u\n", free_space, tx_head, tx_tail, size);
+        }else{
+            ctrl->stats.fifo_empty++;
+        }
+        poll_wait(ctrl, &expect, bytes_in_rx, size);
+		if (bytes_in_rx){
+			st.armed = FALSE;
+		}else if (stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi_transfer: Failed! - Bytes in RX %u, head %u, tail %u, remaining to read %u\n", bytes_in_rx, rx_head, rx_tail, size);
+			return SPI_ERR_TIMEOUT;
+		}
+    }while (size);
+
+	return SPI_OK;
+}
+
+LONG  __asm __saveds spi_read(register __a2 struct SpiController *ctrl, register __a0 UBYTE *buf, register __d0 WORD size)
+{
+	struct SpiSegment seg;
+
+	if (size <= 0){
+		return 0;
+	}
+	count_transfer(ctrl, size);
+	TRACE(TRACE_READ_BEGIN, size, ctrl->controller);
+	spi_obtain_bus(ctrl);
+	seg.type = SPI_SEG_READ;
+	seg.length = size;
+	seg.tx = NULL;
+	seg.rx = buf;
+	if (fifo_read_run(ctrl, &seg, size) != SPI_OK){
+		fifo_abort(ctrl);
+		spi_release_bus(ctrl);
+		TRACE(TRACE_READ_END, SPI_ERR_TIMEOUT, ctrl->controller);
+		return SPI_ERR_TIMEOUT;
+	}
+	spi_release_bus(ctrl);
+	TRACE(TRACE_READ_END, size, ctrl->controller);
+	return size;
+}
+
+LONG  __asm __saveds spi_write(register __a2 struct SpiController *ctrl, register __a0 const UBYTE *buf, register __d0 WORD size)
+{
+	struct SpiSegment seg;
+
+	if (size <= 0){
+		return 0;
+	}
+	count_transfer(ctrl, size);
+	TRACE(TRACE_WRITE_BEGIN, size, ctrl->controller);
+	spi_obtain_bus(ctrl);
+	seg.type = SPI_SEG_WRITE;
+	seg.length = size;
+	seg.tx = buf;
+	seg.rx = NULL;
+	if (fifo_write_run(ctrl, &seg, size) != SPI_OK || fifo_discard_wait(ctrl) != SPI_OK){
+		fifo_abort(ctrl);
+		spi_release_bus(ctrl);
+		TRACE(TRACE_WRITE_END, SPI_ERR_TIMEOUT, ctrl->controller);
+		return SPI_ERR_TIMEOUT;
+	}
+	spi_release_bus(ctrl);
+	TRACE(TRACE_WRITE_END, size, ctrl->controller);
+	return size;
+}
+
+LONG  __asm __saveds spi_transfer(register __a2 struct SpiController *ctrl, register __a0 const UBYTE *tx, register __a1 UBYTE *rx, register __d0 WORD size)
+{
+	if (size <= 0){
+		return 0;
+	}
+	count_transfer(ctrl, size);
+	TRACE(TRACE_XFER_BEGIN, size, ctrl->controller);
+	spi_obtain_bus(ctrl);
+	if (fifo_transfer(ctrl, tx, rx, size) != SPI_OK){
+		fifo_abort(ctrl);
+		spi_release_bus(ctrl);
+		TRACE(TRACE_XFER_END, SPI_ERR_TIMEOUT, ctrl->controller);
+		return SPI_ERR_TIMEOUT;
+	}
+	spi_release_bus(ctrl);
+	TRACE(TRACE_XFER_END, size, ctrl->controller);
+	return size;
+}
+
+// Streaming past the 16 bit firmware length. This relies on two firmware
+// behaviours that are not documented and have only been checked against
+// Host/spisim.c, which was written to the same assumptions:
+//  - TX_FEED and RX_DISCARD are counters that a write replaces, not adds to,
+//    so a new length is only written when the count still left is known
+//    exactly.
+//  - A full RX ring holds the TX_FEED shifter off until bytes are taken.
+// A read therefore pauses the SPI clock once per 64 KB window while the feed
+// is reloaded. The counters cannot be read back, so there is no exact count to
+// reload from earlier while the shifter runs.
+#define STREAM_WINDOW		0xFFFF	// most one length can cover
+#define STREAM_RELOAD_AT	0x7FFF	// feed left below which a full ring reloads it
+
+struct Stream
+{
+	UBYTE *buf;
+	ULONG size;				// bytes per callback, or the whole transfer without one
+	ULONG pos;				// bytes of buf used
+	SPI_STREAM_FUNC func;
+	APTR userdata;
+};
+
+// Reads are fed from a TX_FEED window. A full RX ring (fifo_depth bytes) stops
+// the shifter with fed - taken - fifo_depth of the feed still left, so the window is moved on
+// then. Near the end of a window the ring is left to fill up to make sure that
+// happens before the feed runs out, and the shifter stops until the reload.
+static LONG stream_read(struct SpiController *ctrl, ULONG length, struct Stream *sm)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	volatile UBYTE *fifo = CP_REG(cp, REG_FIFO);
+	ULONG fed = 0, taken = 0, left = 0;
+	UBYTE rx_head = 0, rx_tail = 0, avail = 0, got = 0, chunk = 0;
+	UWORD feed = 0, expect = 0, full = ctrl->fifo_depth;
+	struct Stall st = {0, FALSE};
+
+	feed = length > STREAM_WINDOW ? STREAM_WINDOW : length;
+	CP_WR(cp, REG_UPPER_LENGTH, feed >> 8);
+	CP_WR(cp, REG_TX_FEED, feed & 0xff);
+	fed = feed;
+
+	rx_head = CP_RD(cp, REG_RX_HEAD);
+
+	do{
+		rx_tail = CP_RD(cp, REG_RX_TAIL);
+		avail = got = rx_tail - rx_head;
+
+		if (!got){
+			ctrl->stats.fifo_empty++;
+		}else if (got == full){
+			ctrl->stats.fifo_full++;
+			if (fed < length && fed - taken - full <= STREAM_RELOAD_AT){
+				// Shifter is stopped, everything not yet in the ring is still to come
+				left = length - taken - full;
+				feed = left > STREAM_WINDOW ? STREAM_WINDOW : left;
+				CP_WR(cp, REG_UPPER_LENGTH, feed >> 8);
+				CP_WR(cp, REG_TX_FEED, feed & 0xff);
+				fed = taken + full + feed;
+			}
+		}
+		// Hold back so the ring fills while some of the window is left
+		if (fed < length && taken + avail > fed - (full + 1)){
+			avail = fed - (full + 1) - taken;
+		}
+
+		rx_head += avail;
+		taken += avail;
+		ctrl->stats.bytes_read += avail;
+		while (avail){
+			chunk = avail;
+			if (chunk > sm->size - sm->pos){
+				chunk = sm->size - sm->pos;
+			}
+			copy_from_reg(sm->buf + sm->pos, fifo, chunk);
+			sm->pos += chunk;
+			avail -= chunk;
+			if (sm->func && sm->pos == sm->size){
+				sm->pos = 0;
+				if (!sm->func(ctrl, sm->buf, sm->size, sm->userdata)){
+					return SPI_ERR_ABORTED;
+				}
+			}
+		}
+
+		left = length - taken;
+		poll_wait(ctrl, &expect, got, left > 0xFFFF ? 0xFFFF : left);
+		if (got){
+			st.armed = FALSE;
+		}else if (stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi read: Failed! - head %u, tail %u, remaining to read %lu\n", rx_head, rx_tail, length - taken);
+			return SPI_ERR_TIMEOUT;
+		}
+	}while (taken < length);
+
+	if (sm->func && sm->pos && !sm->func(ctrl, sm->buf, sm->pos, sm->userdata)){
+		return SPI_ERR_ABORTED;
+	}
+	return SPI_OK;
+}
+
+// Takes what is in the RX ring, all of it clocked past an RX_DISCARD window
+static UBYTE stream_drain(struct SpiController *ctrl, UBYTE *rx_head)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	volatile UBYTE *fifo = CP_REG(cp, REG_FIFO);
+	UBYTE bytes = CP_RD(cp, REG_RX_TAIL) - *rx_head, n = bytes;
+
+	*rx_head += bytes;
+	ctrl->stats.bytes_read += bytes;
+	while (n--){
+		FIFO_RD(fifo);
+	}
+	return bytes;
+}
+
+// Writes are covered by RX_DISCARD windows. A window can only be replaced
+// once it has run out, so the bytes clocked between that and the reload land
+// in the RX ring and are read back and dropped. The reload covers no more
+// than is still to be queued, so it always runs out by the end, and exactly
+// length - covered bytes are dropped in all. The TX ring is kept full
+// throughout.
+static LONG stream_write(struct SpiController *ctrl, ULONG length, struct Stream *sm)
+{
+	volatile UBYTE *cp = ctrl->clockport_address;
+	volatile UBYTE *fifo = CP_REG(cp, REG_FIFO);
+	ULONG queued = 0, covered = 0, dropped = 0, left = 0;
+	UBYTE tx_head = 0, tx_tail = 0, rx_head = 0, free_space = 0, got = 0, chunk = 0;
+	UWORD discard = 0, expect = 0;
+	struct Stall st = {0, FALSE};
+
+	discard = length > STREAM_WINDOW ? STREAM_WINDOW : length;
+	CP_WR(cp, REG_UPPER_LENGTH, discard >> 8);
+	CP_WR(cp, REG_RX_DISCARD, discard & 0xff);
+	covered = discard;
+
+	tx_tail = CP_RD(cp, REG_TX_TAIL);
+	rx_head = CP_RD(cp, REG_RX_HEAD);
+
+	while (queued < length){
+		// The window can only have run out once everything it covers is queued
+		if (covered < length && queued >= covered &&
+			(CP_RD(cp, REG_STATUS) & STATUS_RX_DISCARD_EMPTY)){
+			left = length - queued;
+			discard = left > STREAM_WINDOW ? STREAM_WINDOW : left;
+			CP_WR(cp, REG_UPPER_LENGTH, discard >> 8);
+			CP_WR(cp, REG_RX_DISCARD, discard & 0xff);
+			covered += discard;
+			// Nothing more lands until the new window runs out
+			dropped += stream_drain(ctrl, &rx_head);
+		}
+
+		tx_head = CP_RD(cp, REG_TX_HEAD);
+		free_space = got = ctrl->fifo_depth - (UBYTE)(tx_tail - tx_head);
+		if (!got){
+			ctrl->stats.fifo_full++;
+		}else if (got == ctrl->fifo_depth && expect){
+			ctrl->stats.fifo_empty++;
+		}
+		if (free_space > length - queued){
+			free_space = length - queued;
+		}
+		tx_tail += free_space;
+		ctrl->stats.bytes_written += free_space;
+		while (free_space){
+			if (sm->func && sm->pos == sm->size){
+				sm->pos = 0;
+				if (!sm->func(ctrl, sm->buf, length - queued < sm->size ? length - queued : sm->size, sm->userdata)){
+					return SPI_ERR_ABORTED;
+				}
+			}
+			chunk = free_space;
+			if (chunk > sm->size - sm->pos){
+				chunk = sm->size - sm->pos;
+			}
+			copy_to_reg(fifo, sm->buf + sm->pos, chunk);
+			sm->pos += chunk;
+			queued += chunk;
+			free_space -= chunk;
+		}
+
+		left = length - queued;
+		poll_wait(ctrl, &expect, got, left > 0xFFFF ? 0xFFFF : left);
+		if (got){
+			st.armed = FALSE;
+		}else if (stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi write: Failed! - head %u, tail %u, remaining to write %lu\n", tx_head, tx_tail, length - queued);
+			return SPI_ERR_TIMEOUT;
+		}
+	}
+
+	if (fifo_discard_wait(ctrl) != SPI_OK){
+		return SPI_ERR_TIMEOUT;
+	}
+	// The end of the stream past the last window
+	st.armed = FALSE;
+	while (dropped < length - covered){
+		if ((got = stream_drain(ctrl, &rx_head))){
+			dropped += got;
+			st.armed = FALSE;
+		}else if (stall_expired(ctrl, &st)){
+			DebugPrint(DEBUG_LEVEL,"spi write: Failed! - %lu bytes still to come back\n", length - covered - dropped);
+			return SPI_ERR_TIMEOUT;
+		}
+	}
+	return SPI_OK;
+}
+
+static LONG stream_run(struct SpiController *ctrl, BOOL write, ULONG length, struct Stream *sm)
+{
+	LONG err = SPI_OK;
+
+	if (!length){
+		return SPI_OK;
+	}
+	spi_obtain_bus(ctrl);
+	count_transfer(ctrl, length);
+	TRACE(write ? TRACE_WRITE_BEGIN : TRACE_READ_BEGIN, length, ctrl->controller);
+	err = write ? stream_write(ctrl, length, sm) : stream_read(ctrl, length, sm);
+	if (err == SPI_ERR_TIMEOUT){
+		fifo_abort(ctrl);
+	}else if (err != SPI_OK){
+		fifo_reset(ctrl);
+	}
+	TRACE(write ? TRACE_WRITE_END : TRACE_READ_END, err == SPI_OK ? length : (ULONG)err, ctrl->controller);
+	spi_release_bus(ctrl);
+	return err;
+}
+
+LONG spi_read_long(struct SpiController *ctrl, UBYTE *buf, ULONG length)
+{
+	struct Stream sm = {NULL, 0, 0, NULL, NULL};
+
+	sm.buf = buf;
+	sm.size = length;
+	return stream_run(ctrl, FALSE, length, &sm);
+}
+
+LONG spi_write_long(struct SpiController *ctrl, const UBYTE *buf, ULONG length)
+{
+	struct Stream sm = {NULL, 0, 0, NULL, NULL};
+
+	sm.buf = (UBYTE *)buf;
+	sm.size = length;
+	return stream_run(ctrl, TRUE, length, &sm);
+}
+
+LONG spi_read_stream(struct SpiController *ctrl, ULONG length, UBYTE *buf, ULONG bufsize, SPI_STREAM_FUNC consume, APTR userdata)
+{
+	struct Stream sm = {NULL, 0, 0, NULL, NULL};
+
+	if (!bufsize || !consume){
+		return SPI_ERR_PARAM;
+	}
+	sm.buf = buf;
+	sm.size = bufsize;
+	sm.func = consume;
+	sm.userdata = userdata;
+	return stream_run(ctrl, FALSE, length, &sm);
+}
+
+LONG spi_write_stream(struct SpiController *ctrl, ULONG length, UBYTE *buf, ULONG bufsize, SPI_STREAM_FUNC produce, APTR userdata)
+{
+	struct Stream sm = {NULL, 0, 0, NULL, NULL};
+
+	if (!bufsize || !produce){
+		return SPI_ERR_PARAM;
+	}
+	sm.buf = buf;
+	sm.size = bufsize;
+	// Filled by the first call
+	sm.pos = bufsize;
+	sm.func = produce;
+	sm.userdata = userdata;
+	return stream_run(ctrl, TRUE, length, &sm);
+}
+
+void spi_set_timeout(struct SpiController *ctrl, ULONG ms)
+{
+	// Deadlines are compared as signed 32 bit microseconds
+	if (ms > 0x7FFFFFFFUL / 1000){
+		ms = 0x7FFFFFFFUL / 1000;
+	}
+	ctrl->timeout_us = ms * 1000;
+}
+
+LONG spi_transaction(struct SpiController *ctrl, const struct SpiSegment *segs, int count)
+{
+	const struct SpiSegment *run = NULL;
+	BOOL discarding = FALSE, feeds = FALSE;
+	LONG err = SPI_OK;
+	ULONG total = 0;
+	int i = 0, n = 0;
+
+	for (i = 0; i < count; i++){
+		if (segs[i].type > SPI_SEG_DUMMY){
+			return SPI_ERR_PARAM;
+		}
+		total += segs[i].length;
+	}
+	count_transfer(ctrl, total);
+
+	spi_select(ctrl);
+
+	for (i = 0; i < count && err == SPI_OK; i += n){
+		run = &segs[i];
+
+		if (run->type == SPI_SEG_DUPLEX){
+			// Duplex keeps up to fifo_depth bytes in the TX ring, so the ring must be
+			// empty of write data first
+			if (discarding){
+				err = fifo_discard_wait(ctrl);
+				discarding = FALSE;
+			}
+			if (run->length && err == SPI_OK){
+				err = fifo_transfer(ctrl, run->tx, run->rx, run->length);
+			}
+			n = 1;
+			continue;
+		}
+
+		// Neighbouring segments that use the same length register are merged
+		// and programmed once, up to the 16 bit firmware length
+		feeds = run->type != SPI_SEG_WRITE;
+		total = 0;
+		for (n = 0; i + n < count; n++){
+			if ((run[n].type == SPI_SEG_DUPLEX) ||
+				((run[n].type != SPI_SEG_WRITE) != feeds) ||
+				(total + run[n].length > 0xFFFF)){
 				break;
 			}
-        }while (size);
-    }
-	retry = 50000;
-	while((CP_RD(REG_STATUS) & STATUS_RX_DISCARD_EMPTY) == 0){
-		if (--retry == 0){
-			DebugPrint(DEBUG_LEVEL,"spi_write: Failed! - Status 0x%02X\n", CP_RD(REG_STATUS));
-			break;
+			total += run[n].length;
+		}
+		if (total == 0){
+			continue;
+		}
+
+		if (feeds){
+			// Programmed without waiting for an earlier write to drain. Feed bytes
+			// are only clocked once the TX ring is empty and the pending discard
+			// consumes the write's own RX bytes first, so the next length is
+			// set up while the bus is still busy with the previous segment.
+			err = fifo_read_run(ctrl, run, total);
+		}else{
+			// RX_DISCARD is a single counter, it cannot be reloaded while live
+			if (discarding){
+				err = fifo_discard_wait(ctrl);
+			}
+			if (err == SPI_OK){
+				err = fifo_write_run(ctrl, run, total);
+				discarding = TRUE;
+			}
 		}
 	}
+
+	if (discarding && err == SPI_OK){
+		err = fifo_discard_wait(ctrl);
+	}
+	if (err != SPI_OK){
+		fifo_abort(ctrl);
+	}
+
+	spi_deselect(ctrl);
+
+	return err;
 }
 
-static int probe_interface(void)
+// Reads the firmware version into info when cp has a SPIder
+static int probe_interface(volatile UBYTE *cp, struct SpiBoardInfo *info)
 {
     UBYTE read_bytes[IDENT_SIZE], fw_major_ver=0, fw_minor_ver=0, fw_patch_ver=0;
 	BOOL found = FALSE;
     short pos = 0, i=0, start = 0;
 
     for (; i < IDENT_SIZE; i++){
-        read_bytes[i] = CP_RD(REG_IDENT);
+        read_bytes[i] = CP_RD(cp, REG_IDENT);
 	}
 
     for (; start < IDENT_SIZE && !found; start++)
@@ -298,10 +1524,6 @@ static int probe_interface(void)
 
     fw_major_ver = read_bytes[pos];
 
-    // Only major version 1 is currently supported.
-    if (fw_major_ver != 1)
-        return -2;
-
     pos = (pos + 1) & (IDENT_SIZE - 1);
     fw_minor_ver = read_bytes[pos];
 
@@ -310,56 +1532,413 @@ static int probe_interface(void)
 
 	D(DebugPrint(DEBUG_LEVEL,"SPIder firmware version: %ld.%ld.%ld\n", (ULONG)fw_major_ver, (ULONG)fw_minor_ver, (ULONG)fw_patch_ver));
 
+	if (info){
+		info->clockport_address = PTR_BITS(cp);
+		info->fw_major = fw_major_ver;
+		info->fw_minor = fw_minor_ver;
+		info->fw_patch = fw_patch_ver;
+		info->reserved = 0;
+	}
+
+    // Only major version 1 is currently supported.
+    if (fw_major_ver != 1)
+        return -2;
+
     return 0;
 }
 
-int spi_initialize(struct ClockportConfig *config, BYTE sig)
+// Firmware releases, newest last. A board gets the last entry at or below its
+// version within its major version. Only add a row once that release documents
+// what it changed, 16 MHz is the fastest any firmware is known to run.
+static const struct FirmwareCaps
 {
-	LONG int_num = 0;
+	UBYTE major, minor, patch;
+	UBYTE fifo_depth;
+	UBYTE max_speed;
+	UBYTE int_features;
+} firmware_caps[] = {
+	{1, 0, 0, 255, SPI_MHZ(16), SPI_CAP_INT_ARMED | SPI_CAP_INT_GPIO | SPI_CAP_LENGTH16},
+};
 
-    clockport_address = (volatile UBYTE *)config->clockport_address;
-	
-	D(DebugPrint(DEBUG_LEVEL,"SPIder on clockport: %p\n", clockport_address));
+static void caps_for_version(const struct SpiBoardInfo *info, struct SpiCaps *caps)
+{
+	const struct FirmwareCaps *fc = &firmware_caps[0];
+	ULONG version = ((ULONG)info->fw_major << 16) | ((ULONG)info->fw_minor << 8) | info->fw_patch;
+	int i = 0;
+
+	for (; i < sizeof(firmware_caps) / sizeof(firmware_caps[0]); i++){
+		if (firmware_caps[i].major == info->fw_major &&
+			(((ULONG)firmware_caps[i].major << 16) | ((ULONG)firmware_caps[i].minor << 8) | firmware_caps[i].patch) <= version){
+			fc = &firmware_caps[i];
+		}
+	}
+
+	memset(caps, 0, sizeof(struct SpiCaps));
+	caps->fw_major = info->fw_major;
+	caps->fw_minor = info->fw_minor;
+	caps->fw_patch = info->fw_patch;
+	caps->fifo_depth = fc->fifo_depth;
+	caps->max_speed = fc->max_speed;
+	caps->int_features = fc->int_features;
+	// Every kHz code and the MHz codes up to the maximum
+	for (i = SPI_KHZ(1); i <= fc->max_speed; i++){
+		if (i != SPI_MHZ(0)){
+			caps->speeds[i >> 3] |= 1 << (i & 7);
+		}
+	}
+}
 
-    if (probe_interface() < 0)
-        return -1;
+void spi_get_caps(struct SpiController *ctrl, struct SpiCaps *caps)
+{
+	*caps = ctrl->caps;
+}
 
-	spi_set_speed(SPI_SPEED_SLOW);
+// DOS is only safe from a process
+static BOOL can_use_dos(void)
+{
+	return FindTask(NULL)->tc_Node.ln_Type == NT_PROCESS;
+}
 
-	CP_WR(REG_INT_ARMED, 0); // Disarm all
-    //CP_WR(REG_INT_ARMED, 0xFF); // Arm all - TO DO: add some control for different interrupts on pins (via device tree)
-    CP_WR(REG_INT_FIRED, 0);
-	
-    interrupt_data.clockport_address = clockport_address;
-	interrupt_data.sig = sig;
-	interrupt_data.task = FindTask(NULL);
-	interrupt_data.lastINT = 0;
+static void train_var_name(char *name, const char *device)
+{
+	strcpy(name, SPI_TRAIN_VAR);
+	strncat(name, device, SPI_TRAIN_NAME_LEN);
+}
+
+static ULONG load_trained(const char *device)
+{
+	struct DosLibrary *DOSBase = NULL;
+	char name[sizeof(SPI_TRAIN_VAR) + SPI_TRAIN_NAME_LEN];
+	ULONG hz = 0;
+
+	if (can_use_dos() && (DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 36))){
+		train_var_name(name, device);
+		if (GetVar(name, (char *)&hz, sizeof(hz), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_DONT_NULL_TERM) != sizeof(hz)){
+			hz = 0;
+		}
+		CloseLibrary((struct Library *)DOSBase);
+	}
+	return hz;
+}
+
+static void save_trained(const char *device, ULONG hz)
+{
+	struct DosLibrary *DOSBase = NULL;
+	char name[sizeof(SPI_TRAIN_VAR) + SPI_TRAIN_NAME_LEN];
+
+	if (can_use_dos() && (DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 36))){
+		train_var_name(name, device);
+		SetVar(name, (char *)&hz, sizeof(hz), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_SAVE_VAR);
+		CloseLibrary((struct Library *)DOSBase);
+	}
+}
+
+ULONG spi_train_speed(struct SpiController *ctrl, const char *device, ULONG min_hz, ULONG max_hz,
+	SPI_VERIFY_FUNC verify, APTR userdata, ULONG flags)
+{
+	UBYTE good = 0, bad = 0, next = 0, top = 0, old = ctrl->speedMode;
+	ULONG hz = 0;
+
+	// A cached rate only has to pass once more
+	if (device && !(flags & SPI_TRAIN_RETRAIN) && (hz = load_trained(device))){
+		hz = spi_set_frequency(ctrl, hz);
+		if (hz >= min_hz && hz <= max_hz && verify(ctrl, userdata)){
+			return hz;
+		}
+	}
+
+	good = speed_for_hz(&ctrl->caps, min_hz);
+	top = speed_for_hz(&ctrl->caps, max_hz);
+	spi_set_speed(ctrl, good);
+	if (!verify(ctrl, userdata)){
+		spi_set_speed(ctrl, old);
+		return 0;
+	}
+
+	// Double the rate while it passes, then narrow down between the last
+	// pass and the first failure
+	while (good < top){
+		next = speed_for_hz(&ctrl->caps, speed_khz(good) * 2000);
+		if (next <= good){
+			next = speed_up(&ctrl->caps, good);
+		}
+		if (next > top){
+			next = top;
+		}
+		spi_set_speed(ctrl, next);
+		if (!verify(ctrl, userdata)){
+			bad = next;
+			break;
+		}
+		good = next;
+	}
+	while (bad && speed_up(&ctrl->caps, good) < bad){
+		next = supported_speed(&ctrl->caps, (UBYTE)(((UWORD)good + bad) / 2));
+		if (next <= good){
+			next = speed_up(&ctrl->caps, good);
+		}
+		spi_set_speed(ctrl, next);
+		if (verify(ctrl, userdata)){
+			good = next;
+		}else{
+			bad = next;
+		}
+	}
+
+	spi_set_speed(ctrl, good);
+	hz = spi_get_frequency(ctrl);
+	D(DebugPrint(DEBUG_LEVEL,"SPIder: trained %s to %lu Hz\n", device ? device : "", hz));
+	if (device){
+		save_trained(device, hz);
+	}
+	return hz;
+}
+
+static int load_discovered(struct SpiBoardInfo *boards)
+{
+	struct DosLibrary *DOSBase = NULL;
+	LONG len = -1;
+
+	if (can_use_dos() && (DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 36))){
+		len = GetVar(SPI_DISCOVER_VAR, (char *)boards, SPI_CLOCKPORTS * sizeof(struct SpiBoardInfo), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_DONT_NULL_TERM);
+		CloseLibrary((struct Library *)DOSBase);
+	}
+	return len > 0 && len % sizeof(struct SpiBoardInfo) == 0 ? len / sizeof(struct SpiBoardInfo) : -1;
+}
+
+static void save_discovered(const struct SpiBoardInfo *boards, int count)
+{
+	struct DosLibrary *DOSBase = NULL;
+
+	if (can_use_dos() && (DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 36))){
+		SetVar(SPI_DISCOVER_VAR, (char *)boards, count * sizeof(struct SpiBoardInfo), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_SAVE_VAR);
+		CloseLibrary((struct Library *)DOSBase);
+	}
+}
+
+int spi_discover(struct SpiBoardInfo *boards, int max, ULONG flags)
+{
+	static const ULONG addresses[SPI_CLOCKPORTS] = SPI_CLOCKPORT_ADDRESSES;
+	struct SpiBoardInfo found[SPI_CLOCKPORTS], info;
+	int count = -1, i = 0;
+
+	// The cached boards stand if each still answers with the same firmware.
+	// An empty cache is not trusted, a board may have been fitted since.
+	if (!(flags & SPI_DISCOVER_RESCAN) && (count = load_discovered(found)) > 0){
+		for (i = 0; i < count; i++){
+			if (probe_interface(CP_ADDR(found[i].clockport_address), &info) == -1 ||
+				memcmp(&info, &found[i], sizeof(struct SpiBoardInfo)) != 0){
+				count = -1;
+				break;
+			}
+		}
+	}
+
+	if (count <= 0){
+		count = 0;
+		for (i = 0; i < SPI_CLOCKPORTS; i++){
+			// Unsupported firmware is still reported, spi_initialize() refuses it
+			if (probe_interface(CP_ADDR(addresses[i]), &found[count]) != -1){
+				count++;
+			}
+		}
+		save_discovered(found, count);
+	}
+
+	for (i = 0; i < count && i < max; i++){
+		boards[i] = found[i];
+	}
+	return count;
+}
+
+// The configured address has no usable SPIder, take the first discovered one.
+// Only with ClockportConfig.discover set, probing other clockports is opt-in.
+static volatile UBYTE *discover_fallback(volatile UBYTE *cp)
+{
+	struct SpiBoardInfo boards[SPI_CLOCKPORTS];
+	int count = spi_discover(boards, SPI_CLOCKPORTS, 0), i = 0;
+
+	for (; i < count; i++){
+		if (boards[i].fw_major == 1){
+			D(DebugPrint(ERROR_LEVEL,"SPIder: none at %p, using the one at 0x%06lx\n", cp, boards[i].clockport_address));
+			return CP_ADDR(boards[i].clockport_address);
+		}
+	}
+	return NULL;
+}
+
+struct SpiController *spi_initialize(struct ClockportConfig *config, unsigned char controller, BYTE sig)
+{
+	struct SpiController *ctrl = NULL, *peer = NULL;
+	volatile UBYTE *cp = CP_ADDR(config->clockport_address);
+	struct SpiBoardInfo info;
+
+	if (controller >= SPI_CONTROLLERS){
+		return NULL;
+	}
 	
-	memset(&ports_interrupt, 0, sizeof(struct Interrupt));
+	D(DebugPrint(DEBUG_LEVEL,"SPIder on clockport: %p, controller %u\n", cp, controller));
+
+	if (probe_interface(cp, &info) < 0 && (!config->discover || !(cp = discover_fallback(cp)) || probe_interface(cp, &info) < 0)){
+		return NULL;
+	}
+
+	select_copy_kernels();
 
-    ports_interrupt.is_Node.ln_Type = NT_INTERRUPT;
-    ports_interrupt.is_Node.ln_Pri = -60;
-    ports_interrupt.is_Node.ln_Name = (char *)spi_lib_name;
-    ports_interrupt.is_Data = (APTR)&interrupt_data;
-    ports_interrupt.is_Code = (VOID_FUNC)SPI_Interrupt;
+	// Transfer timeouts run off the microsecond clock
+	if (!timer_clock_open()){
+		return NULL;
+	}
+
+	if (!(ctrl = AllocMem(sizeof(struct SpiController), MEMF_PUBLIC | MEMF_CLEAR))){
+		D(DebugPrint(ERROR_LEVEL,"SPIder: cannot allocate controller\n"));
+		timer_clock_close();
+		return NULL;
+	}
 
-    int_num = config->interrupt_number == 2 ? INTB_PORTS : (config->interrupt_number == 3 ? INTB_VERTB : INTB_EXTER);
-	AddIntServer(int_num, &ports_interrupt);
+	ctrl->clockport_address = cp;
+	ctrl->controller = controller;
+	ctrl->select_mask = 1 << controller;
+	ctrl->bus_pri = FindTask(NULL)->tc_Node.ln_Pri;
+	caps_for_version(&info, &ctrl->caps);
+	if (!(ctrl->caps.int_features & SPI_CAP_LENGTH16)){
+		// Every transfer writes REG_UPPER_LENGTH
+		D(DebugPrint(ERROR_LEVEL,"SPIder: firmware has no 16 bit lengths\n"));
+		FreeMem(ctrl, sizeof(struct SpiController));
+		timer_clock_close();
+		return NULL;
+	}
+	ctrl->fifo_depth = ctrl->caps.fifo_depth;
+	D(DebugPrint(DEBUG_LEVEL,"SPIder: FIFO %u, fastest speed code %u\n", ctrl->caps.fifo_depth, ctrl->caps.max_speed));
+	spi_set_timeout(ctrl, SPI_DEFAULT_TIMEOUT_MS);
+
+	ctrl->byte_iters = 0;	// seeded by the first spi_set_speed()
+
+    ctrl->interrupt_data.clockport_address = cp;
+	ctrl->interrupt_data.sig = sig;
+	ctrl->interrupt_data.task = FindTask(NULL);
+	spi_set_pin_handler(ctrl, 0xFF, -1, NULL);
+
+	// Allocated up front as nothing may wait under Forbid(), dropped again if
+	// the board already has one
+	if (!(ctrl->board = AllocMem(sizeof(struct BoardState), MEMF_PUBLIC | MEMF_CLEAR))){
+		D(DebugPrint(ERROR_LEVEL,"SPIder: cannot allocate board state\n"));
+		FreeMem(ctrl, sizeof(struct SpiController));
+		timer_clock_close();
+		return NULL;
+	}
+	NewList(&ctrl->board->waiters);
+
+	// A new handle owns the pins no other handle on the board has taken, drivers
+	// narrow that down with spi_arm_pins(). Joining the board happens in the same
+	// Forbid(), so two handles opened at once cannot both take every pin.
+	Forbid();
+	if ((peer = board_peer(ctrl))){
+		FreeMem(ctrl->board, sizeof(struct BoardState));
+		ctrl->board = peer->board;
+	}else{
+		// First user of this board
+		if (ctrl->caps.int_features & SPI_CAP_INT_ARMED){
+			CP_WR(cp, REG_INT_ARMED, 0); // Disarm all
+		}
+		CP_WR(cp, REG_INT_FIRED, 0);
+	}
+	ctrl->interrupt_data.int_mask = ~board_pins(ctrl, FALSE);
+	AddTail((struct List *)&open_controllers, (struct Node *)&ctrl->node);
+	Permit();
+
+    ctrl->int_num = config->interrupt_number == 2 ? INTB_PORTS : (config->interrupt_number == 3 ? INTB_VERTB : INTB_EXTER);
+	ctrl->interrupt_data.claim = ctrl->int_num != INTB_VERTB;
+	// Firmware that raises no pin interrupts gets no server, is_Data stays NULL
+	if (ctrl->caps.int_features & SPI_CAP_INT_GPIO){
+		ctrl->ports_interrupt.is_Node.ln_Type = NT_INTERRUPT;
+		ctrl->ports_interrupt.is_Node.ln_Pri = -60;
+		ctrl->ports_interrupt.is_Node.ln_Name = (char *)spi_lib_name;
+		ctrl->ports_interrupt.is_Data = (APTR)&ctrl->interrupt_data;
+		ctrl->ports_interrupt.is_Code = (VOID_FUNC)SPI_Interrupt;
+		AddIntServer(ctrl->int_num, &ctrl->ports_interrupt);
+	}
 
-	CP_WR(REG_INT_ARMED, 0xFF); 
+	spi_set_speed(ctrl, SPI_SPEED_SLOW);
+	spi_enable_interrupt(ctrl);
     
-	return 0;
+	return ctrl;
 }
 
-void spi_shutdown(void)
+struct SpiController *spi_open_profile(const char *name, BYTE sig)
 {
-	LONG int_num = 0;
-	
-    CP_WR(REG_INT_ARMED, 0);
-    CP_WR(REG_INT_FIRED, 0);
+	struct ClockportConfig cp = {CONFIG_DEFAULT_CLOCKPORT, CONFIG_DEFAULT_INTERRUPT};
+	const struct SpiConfig *cfg = NULL;
+	const struct SpiProfile *prof = NULL;
+	struct SpiProfile p;
+	struct SpiController *ctrl = NULL;
+
+	if (!(cfg = config_obtain())){
+		return NULL;
+	}
+	if ((prof = config_find_profile(cfg, name))){
+		p = *prof;
+		if (cfg->clockport.clockport_address){
+			cp.clockport_address = cfg->clockport.clockport_address;
+		}
+		if (cfg->clockport.interrupt_number){
+			cp.interrupt_number = cfg->clockport.interrupt_number;
+		}
+		cp.discover = cfg->clockport.discover;
+	}
+	config_release(cfg);
+	if (!prof){
+		D(DebugPrint(ERROR_LEVEL,"SPIder: no profile %s\n", name));
+		return NULL;
+	}
+
+	if (!(ctrl = spi_initialize(&cp, p.controller, sig))){
+		return NULL;
+	}
+	if (p.chip_select){
+		ctrl->select_mask = p.chip_select;
+	}
+	if (p.interrupt_pins){
+		spi_arm_pins(ctrl, p.interrupt_pins);
+	}
+	if (p.timeout_ms){
+		spi_set_timeout(ctrl, p.timeout_ms);
+	}
+	if (p.max_frequency){
+		spi_set_frequency(ctrl, p.max_frequency);
+	}
+	return ctrl;
+}
+
+void spi_shutdown(struct SpiController *ctrl)
+{
+	volatile UBYTE *cp = NULL;
+
+	if (!ctrl){
+		return;
+	}
+	cp = ctrl->clockport_address;
+	// Closed while selected, drop the hold so the other handles get the bus back
+	if (ctrl->select_hold){
+		spi_deselect(ctrl);
+	}
+
+	Forbid();
+	Remove((struct Node *)&ctrl->node);
+	// Leave only the pins of the handles still open armed
+	if (ctrl->caps.int_features & SPI_CAP_INT_ARMED){
+		CP_WR(cp, REG_INT_ARMED, board_pins(ctrl, TRUE));
+	}
+	if (!board_shared(ctrl)){
+		// Last user of this board
+		CP_WR(cp, REG_INT_FIRED, 0);
+		FreeMem(ctrl->board, sizeof(struct BoardState));
+	}
+	Permit();
 
-    int_num = clockport_config.interrupt_number == 2 ? INTB_PORTS : (clockport_config.interrupt_number == 3 ? INTB_VERTB : INTB_EXTER);
-	if (ports_interrupt.is_Data){ // Check one of the attributes is set, indicating the interrupt exists
-		RemIntServer(int_num, &ports_interrupt);
+	if (ctrl->ports_interrupt.is_Data){ // Check one of the attributes is set, indicating the interrupt exists
+		RemIntServer(ctrl->int_num, &ctrl->ports_interrupt);
 	}
+	FreeMem(ctrl, sizeof(struct SpiController));
+	timer_clock_close();
 }
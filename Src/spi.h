@@ -8,32 +8,246 @@
 #define SPI_H_
 
 #include <exec/types.h>
+#include <exec/interrupts.h>
 
 #define SPI_MHZ(x)				(128 + x)
 #define SPI_KHZ(x)				x
 
 #define SPI_SPEED_SLOW SPI_KHZ(40)
 #define SPI_SPEED_FAST SPI_MHZ(16)
+#define SPI_SPEED_MAX 0				// fastest the board's firmware supports
+
+// Transfer results, the transfer functions return a byte count or one of the errors
+#define SPI_OK					0
+#define SPI_ERR_TIMEOUT			-1	// no FIFO progress within the timeout, FIFO has been reset
+#define SPI_ERR_PARAM			-2
+#define SPI_ERR_ABORTED			-3	// a stream callback returned FALSE, FIFO has been reset
+
+#define SPI_DEFAULT_TIMEOUT_MS	100
 
 #define SPIDER_PINID(x)			(1 << (x-20))
 #define PIN_CD					SPIDER_PINID(20)
 #define PIN_INT					SPIDER_PINID(21)
 
-int spi_initialize(struct ClockportConfig *config, BYTE sig); // Set sig to use when interrupts fired.
-void spi_diag(void); // print state of SPI interrupts and GPIO vals
+struct ClockportConfig;
+struct SpiController;
+
+// A SPIder found by spi_discover()
+struct SpiBoardInfo
+{
+	ULONG clockport_address;
+	UBYTE fw_major;
+	UBYTE fw_minor;
+	UBYTE fw_patch;
+	UBYTE reserved;
+};
+
+// What the firmware on a board can do, from its version. See spi_get_caps().
+#define SPI_CAP_INT_ARMED		0x01	// REG_INT_ARMED masks which pins interrupt, otherwise it is not written
+#define SPI_CAP_INT_GPIO		0x02	// PIN_CD and PIN_INT changes raise interrupts, otherwise no server is added
+#define SPI_CAP_LENGTH16		0x04	// TX_FEED and RX_DISCARD take 16 bit lengths, required by spi_initialize()
+
+struct SpiCaps
+{
+	UBYTE fw_major;
+	UBYTE fw_minor;
+	UBYTE fw_patch;
+	UBYTE fifo_depth;			// usable bytes in each of the TX and RX rings
+	UBYTE max_speed;			// fastest REG_SPI_FREQ encoding
+	UBYTE int_features;			// SPI_CAP_ flags
+	UWORD reserved;
+	UBYTE speeds[32];			// bit per REG_SPI_FREQ encoding the firmware accepts
+};
+
+#define SPI_CAP_SPEED(caps, speed)	((caps)->speeds[(UBYTE)(speed) >> 3] & (1 << ((speed) & 7)))
+
+// Clockport windows spi_discover() looks at: A1200 and the usual expansion ports
+#define SPI_CLOCKPORTS			5
+#define SPI_CLOCKPORT_ADDRESSES	{0xD80001, 0xD84001, 0xD88001, 0xD8C001, 0xD90001}
+
+// ENV: variable caching the last discovery, saved to ENVARC: too
+#define SPI_DISCOVER_VAR		"spider-boards"
+// spi_discover() flag: probe every window even if the cached boards still answer
+#define SPI_DISCOVER_RESCAN		1
+
+// SPIder provides two controllers. Each asserts its own SS line, the FIFO and
+// GPIO registers are shared by both on the same board.
+#define SPI_CONTROLLERS			2
+
+// Segment types for spi_transaction()
+#define SPI_SEG_WRITE			0	// send tx, received bytes are discarded
+#define SPI_SEG_READ			1	// clock out dummy bytes, store received bytes in rx
+#define SPI_SEG_DUPLEX			2	// send tx and store received bytes in rx
+#define SPI_SEG_DUMMY			3	// clock out dummy bytes, received bytes are discarded
+
+struct SpiSegment
+{
+	unsigned char type;
+	unsigned char reserved;
+	unsigned short length;
+	const unsigned char *tx;
+	unsigned char *rx;
+};
+
+// Transfer size buckets for SpiStats.transfers: 1-15, 16-63, 64-255, 256-1023, 1024-4095, 4096+
+#define SPI_SIZE_BUCKETS		6
 
-void spider_usr_reset(int val);
-void spi_enable_interrupt(void);
-void spi_disable_interrupt(void);
-// Returns bit mask of pin which fired the interrupt and clears the interrupt to fire again
-unsigned char spi_reset_interrupt(void);
+// Always on counters, kept per handle. Counters wrap, take differences.
+struct SpiStats
+{
+	ULONG bytes_read;			// bytes taken from the RX ring, including dummy reads
+	ULONG bytes_written;		// bytes put in the TX ring
+	ULONG transfers[SPI_SIZE_BUCKETS];	// read/write/transfer/transaction calls by total length
+	ULONG polls;				// FIFO head/tail reads
+	ULONG poll_bytes;			// bytes those reads made available, poll_bytes/polls is the copy burst size
+	ULONG spins;				// local spins between polls
+	ULONG fifo_full;			// polls finding no TX room, or a full RX ring holding the bus off
+	ULONG fifo_empty;			// polls finding nothing received, or a drained TX ring starving the bus
+	ULONG timeouts;				// transfers failed with SPI_ERR_TIMEOUT
+	ULONG interrupts;			// interrupt server calls with one of our pins fired
+	ULONG spurious_interrupts;	// interrupt server calls with none of our pins fired
+	ULONG events_dropped;		// pin events lost to a full event ring
+	ULONG writes_skipped;		// speed changes and selects left unwritten as the board already had the value
+	ULONG bus_waits;			// obtains that found another task owning the bus
+	ULONG bus_wait_us;			// time those spent waiting
+	ULONG bus_wait_max_us;
+	ULONG bus_yields;			// spi_yield_bus() calls that gave the bus away
+};
+
+// Settings of one device on the bus, for drivers switching between several
+struct SpiDevice
+{
+	UBYTE speed;				// speed code, as for spi_set_speed()
+	UBYTE select_mask;			// REG_SLAVE_SELECT value to assert the device's SS
+	UWORD reserved;
+	ULONG timeout_ms;			// 0 keeps the handle's timeout
+};
+
+// Pin interrupt events are queued by the interrupt server, up to SPI_EVENT_RING
+// of them, for the task that opened the handle to collect with spi_get_events()
+#define SPI_EVENT_RING			16
+
+struct SpiEvent
+{
+	ULONG micros;				// timer_micros() when the interrupt was taken
+	UBYTE pins;					// pins that fired, SPIDER_PINID() bits
+	UBYTE gpios;				// pin levels read in the same interrupt
+	UWORD reserved;
+};
+
+// Returns a handle for controller 0 or 1 on the configured clockport, NULL on failure.
+// Set sig to use when interrupts fired. With config->discover set, a board found by
+// spi_discover() is used when none answers at the configured address.
+struct SpiController *spi_initialize(struct ClockportConfig *config, unsigned char controller, BYTE sig);
+// Opens the controller of the named profile in the config file and applies its chip select,
+// interrupt pins, timeout and maximum frequency. NULL if there is no such profile.
+struct SpiController *spi_open_profile(const char *name, BYTE sig);
+// Fills up to max SPIder boards and returns how many there are. Boards cached in
+// SPI_DISCOVER_VAR are checked first and the windows are only all probed again if one
+// of them has gone or with SPI_DISCOVER_RESCAN. Probing reads REG_IDENT of each window,
+// which other clockport hardware sees as reads of its own registers.
+int spi_discover(struct SpiBoardInfo *boards, int max, ULONG flags);
+void spi_diag(struct SpiController *ctrl); // print state of SPI interrupts, GPIO vals and statistics
+void spi_get_stats(struct SpiController *ctrl, struct SpiStats *stats);
+void spi_get_caps(struct SpiController *ctrl, struct SpiCaps *caps);
+void spi_reset_stats(struct SpiController *ctrl);
+
+void spider_usr_reset(struct SpiController *ctrl, int val);
+// Arm or disarm the pins this handle owns, other handles on the board are not affected
+void spi_enable_interrupt(struct SpiController *ctrl);
+void spi_disable_interrupt(struct SpiController *ctrl);
+// Choose the pins (SPIDER_PINID() bits) this handle owns. A new handle owns every pin no other
+// handle on the same board has, give each pin to only one handle.
+void spi_arm_pins(struct SpiController *ctrl, unsigned char pins);
+// Route pins to a soft interrupt that is Cause()d, or without one to signal sig on the opening
+// task. sig -1 with no softint goes back to the signal passed to spi_initialize().
+void spi_set_pin_handler(struct SpiController *ctrl, unsigned char pins, BYTE sig, struct Interrupt *softint);
+// Drains every queued event, returns the pins that fired in any of them and clears the interrupt to fire again
+unsigned char spi_reset_interrupt(struct SpiController *ctrl);
+// Copies up to max queued events oldest first and removes them from the ring, returns how many were copied.
+// Only the task that opened the handle may drain it.
+int spi_get_events(struct SpiController *ctrl, struct SpiEvent *events, int max);
 // Get the value of pin provided into function. 1 for high and 0 for low
-int spi_pin_val(unsigned char pin);
-void spi_shutdown(void);
-void spi_set_speed(unsigned char speed); // Set speed or use macros for FAST or SLOW
-void spi_select(void); //enable SS/CS (low)
-void spi_deselect(void); //disable SS/CS (high)
-void __asm __saveds spi_read(register __a0 unsigned char *buf, register __d0 short size);
-void __asm __saveds spi_write(register __a0 const unsigned char *buf, register __d0 short size);
+int spi_pin_val(struct SpiController *ctrl, unsigned char pin);
+void spi_shutdown(struct SpiController *ctrl); // Releases the handle
+// Runs at the fastest supported frequency at or below hz, or the slowest if hz is below
+// them all. Returns the frequency set.
+ULONG spi_set_frequency(struct SpiController *ctrl, ULONG hz);
+ULONG spi_get_frequency(struct SpiController *ctrl);
+// Set speed or use macros for FAST, SLOW or MAX. Speeds the firmware does not support are
+// lowered to the next one it does.
+void spi_set_speed(struct SpiController *ctrl, unsigned char speed);
+// Fills dev with the fastest supported speed at or below hz. select_mask 0 selects the
+// handle's own controller.
+void spi_device_init(struct SpiController *ctrl, struct SpiDevice *dev, ULONG hz, UBYTE select_mask, ULONG timeout_ms);
+// Switches the handle to dev. Call while deselected. The board's speed and select registers
+// are only written when they differ from what was last written, by this or any handle.
+void spi_use_device(struct SpiController *ctrl, struct SpiDevice *dev);
+// Selecting takes ownership of the bus until the matching deselect
+void spi_select(struct SpiController *ctrl); //enable SS/CS (low)
+void spi_deselect(struct SpiController *ctrl); //disable SS/CS (high)
+
+// Bus ownership. Every handle on a board shares one bus, owned by one task at a time.
+// spi_select() to spi_deselect() and each read, write, transfer and transaction hold it
+// already, obtain it explicitly to keep several of those together. Obtains nest within
+// a task, also across its handles, and each needs a release. An uncontended obtain is
+// a single instruction, others sleep in order of bus priority, then of arrival, and
+// are handed the bus directly on release. A new obtain never overtakes a queued one.
+// There are no fairness weights, a busy high priority handle can starve lower ones.
+// Never from interrupts.
+void spi_obtain_bus(struct SpiController *ctrl);
+// Obtains the bus only if it is free and nobody queues for it
+BOOL spi_attempt_bus(struct SpiController *ctrl);
+void spi_release_bus(struct SpiController *ctrl);
+// TRUE if a task waits for the bus at this handle's priority or above
+BOOL spi_bus_contended(struct SpiController *ctrl);
+// Lets such a task have the bus and waits to get it back, for long jobs between their
+// transactions. Does nothing while selected. Returns TRUE if the bus was given away.
+BOOL spi_yield_bus(struct SpiController *ctrl);
+// Higher goes first, the default is the priority of the task that opened the handle
+void spi_set_bus_priority(struct SpiController *ctrl, BYTE pri);
+// Longest a transfer may make no progress before it fails with SPI_ERR_TIMEOUT
+void spi_set_timeout(struct SpiController *ctrl, ULONG ms);
+
+// Checks the device works at the current speed, for example a CRC checked read
+typedef BOOL (*SPI_VERIFY_FUNC)(struct SpiController *ctrl, APTR userdata);
+
+// ENV: variable prefix for trained rates, followed by the device name
+#define SPI_TRAIN_VAR			"spider-speed-"
+#define SPI_TRAIN_NAME_LEN		32
+// spi_train_speed() flag: ignore the cached rate
+#define SPI_TRAIN_RETRAIN		1
+
+// Finds the fastest rate between min_hz and max_hz at which verify passes, stepping up
+// from min_hz, and leaves the controller at it. With a device name the result is cached in
+// ENV:/ENVARC: and next time only that rate is verified. Returns the rate or 0 if verify
+// fails at min_hz, in which case the old speed is restored.
+ULONG spi_train_speed(struct SpiController *ctrl, const char *device, ULONG min_hz, ULONG max_hz,
+	SPI_VERIFY_FUNC verify, APTR userdata, ULONG flags);
+// Return size or SPI_ERR_TIMEOUT
+LONG __asm __saveds spi_read(register __a2 struct SpiController *ctrl, register __a0 unsigned char *buf, register __d0 short size);
+LONG __asm __saveds spi_write(register __a2 struct SpiController *ctrl, register __a0 const unsigned char *buf, register __d0 short size);
+// Full duplex - send size bytes from tx and store the size bytes received into rx
+LONG __asm __saveds spi_transfer(register __a2 struct SpiController *ctrl, register __a0 const unsigned char *tx, register __a1 unsigned char *rx, register __d0 short size);
+
+// Transfers of any length. The firmware lengths are reloaded every 64 KB. Writes keep the
+// SPI clock going across the windows for as long as the CPU keeps up, reads stop it with
+// the RX ring full for the time one reload takes. SS is left as it is. Return SPI_OK, SPI_ERR_TIMEOUT or SPI_ERR_ABORTED.
+LONG spi_read_long(struct SpiController *ctrl, unsigned char *buf, ULONG length);
+LONG spi_write_long(struct SpiController *ctrl, const unsigned char *buf, ULONG length);
+
+// Gets each bufsize bytes received, the last call may have fewer, or fills the first length
+// bytes of buf with the next ones to send. FALSE stops the transfer. The bus waits on the
+// FIFO while it runs.
+typedef BOOL (*SPI_STREAM_FUNC)(struct SpiController *ctrl, unsigned char *buf, ULONG length, APTR userdata);
+
+// As above through a buffer of bufsize bytes and a callback, for data not all in memory
+LONG spi_read_stream(struct SpiController *ctrl, ULONG length, unsigned char *buf, ULONG bufsize,
+	SPI_STREAM_FUNC consume, APTR userdata);
+LONG spi_write_stream(struct SpiController *ctrl, ULONG length, unsigned char *buf, ULONG bufsize,
+	SPI_STREAM_FUNC produce, APTR userdata);
+// Runs count segments back to back with SS held for the whole transaction.
+// Returns SPI_OK, SPI_ERR_TIMEOUT or SPI_ERR_PARAM if a segment type is invalid.
+LONG spi_transaction(struct SpiController *ctrl, const struct SpiSegment *segs, int count);
 
 #endif
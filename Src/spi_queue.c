@@ -0,0 +1,207 @@
+/*
+ * Asynchronous transfer queue for spiderdev.lib
+ */
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/ports.h>
+#include <exec/tasks.h>
+#include <dos/dos.h>
+
+#include <proto/exec.h>
+#include <clib/alib_protos.h>
+
+#include "spi_queue.h"
+#include "debug.h"
+
+#define SERVER_STACK_SIZE	4096
+
+static const char spi_queue_name[] = "spi-lib-spider queue";
+
+struct SpiQueue
+{
+	struct SpiController *ctrl;
+	struct MsgPort *port;				// Owned by the server task
+	struct Task *server;
+	struct Task *creator;				// Handshake with the server on start and stop
+	BYTE handshake_sig;
+	BYTE done_sig;						// Creator's signal for requests with no reply port
+	struct MinList free_requests;
+	int pool_size;
+	struct SpiRequest *pool;
+};
+
+static void __saveds queue_server(void)
+{
+	struct SpiQueue *q = (struct SpiQueue *)FindTask(NULL)->tc_UserData;
+	struct SpiRequest *req = NULL;
+	ULONG sigs = 0, portsig = 0;
+
+	q->port = CreateMsgPort();
+	Signal(q->creator, 1L << q->handshake_sig);
+	if (!q->port){
+		return;
+	}
+	portsig = 1L << q->port->mp_SigBit;
+
+	do{
+		sigs = Wait(portsig | SIGBREAKF_CTRL_C);
+
+		while ((req = (struct SpiRequest *)GetMsg(q->port))){
+			req->result = spi_transaction(q->ctrl, req->segs, req->count);
+
+			if (req->msg.mn_ReplyPort){
+				ReplyMsg(&req->msg);
+			}else{
+				req->msg.mn_Node.ln_Type = NT_REPLYMSG;
+				Signal(req->task, req->sigmask);
+			}
+		}
+	}while ((sigs & SIGBREAKF_CTRL_C) == 0);
+
+	DeleteMsgPort(q->port);
+	q->port = NULL;
+
+	// Do not let the creator free anything until this task has gone
+	Forbid();
+	Signal(q->creator, 1L << q->handshake_sig);
+}
+
+struct SpiQueue *spi_queue_create(struct SpiController *ctrl, int pool_size, LONG pri)
+{
+	struct SpiQueue *q = NULL;
+	int i = 0;
+
+	if (!(q = AllocMem(sizeof(struct SpiQueue), MEMF_PUBLIC | MEMF_CLEAR))){
+		return NULL;
+	}
+	if (!(q->pool = AllocMem(pool_size * sizeof(struct SpiRequest), MEMF_PUBLIC | MEMF_CLEAR))){
+		FreeMem(q, sizeof(struct SpiQueue));
+		return NULL;
+	}
+	q->ctrl = ctrl;
+	q->pool_size = pool_size;
+	NewList((struct List *)&q->free_requests);
+	for (i = 0; i < pool_size; i++){
+		q->pool[i].queue = q;
+		AddTail((struct List *)&q->free_requests, &q->pool[i].msg.mn_Node);
+	}
+
+	q->creator = FindTask(NULL);
+	q->done_sig = -1;
+	if ((q->handshake_sig = AllocSignal(-1)) < 0 || (q->done_sig = AllocSignal(-1)) < 0){
+		goto fail;
+	}
+
+	Forbid();
+	if ((q->server = CreateTask(spi_queue_name, pri, (APTR)queue_server, SERVER_STACK_SIZE))){
+		q->server->tc_UserData = q;
+	}
+	Permit();
+	if (!q->server){
+		D(DebugPrint(ERROR_LEVEL,"spi_queue_create: cannot create server task\n"));
+		goto fail;
+	}
+
+	Wait(1L << q->handshake_sig);
+	if (!q->port){
+		D(DebugPrint(ERROR_LEVEL,"spi_queue_create: server has no port\n"));
+		goto fail;
+	}
+
+	return q;
+
+fail:
+	if (q->done_sig >= 0){
+		FreeSignal(q->done_sig);
+	}
+	if (q->handshake_sig >= 0){
+		FreeSignal(q->handshake_sig);
+	}
+	FreeMem(q->pool, pool_size * sizeof(struct SpiRequest));
+	FreeMem(q, sizeof(struct SpiQueue));
+	return NULL;
+}
+
+void spi_queue_delete(struct SpiQueue *q)
+{
+	if (!q){
+		return;
+	}
+
+	SetSignal(0, 1L << q->handshake_sig);
+	Signal(q->server, SIGBREAKF_CTRL_C);
+	Wait(1L << q->handshake_sig);
+
+	FreeSignal(q->done_sig);
+	FreeSignal(q->handshake_sig);
+	FreeMem(q->pool, q->pool_size * sizeof(struct SpiRequest));
+	FreeMem(q, sizeof(struct SpiQueue));
+}
+
+struct SpiRequest *spi_alloc_request(struct SpiQueue *q)
+{
+	struct SpiRequest *req = NULL;
+
+	Forbid();
+	req = (struct SpiRequest *)RemHead((struct List *)&q->free_requests);
+	Permit();
+
+	if (req){
+		req->msg.mn_Node.ln_Type = NT_UNKNOWN;
+		req->msg.mn_ReplyPort = NULL;
+		req->msg.mn_Length = sizeof(struct SpiRequest);
+		req->task = FindTask(NULL);
+		// The queue's signal is only allocated in the creating task, other tasks
+		// set a reply port or a signal of their own. SIGF_SINGLE belongs to
+		// semaphores and must not be used.
+		req->sigmask = req->task == q->creator ? 1L << q->done_sig : 0;
+		req->segs = NULL;
+		req->count = 0;
+		req->result = 0;
+	}
+	return req;
+}
+
+void spi_free_request(struct SpiRequest *req)
+{
+	Forbid();
+	AddTail((struct List *)&req->queue->free_requests, &req->msg.mn_Node);
+	Permit();
+}
+
+void spi_submit(struct SpiRequest *req)
+{
+	// Nothing could tell the caller it is done, fail it straight away
+	if (!req->msg.mn_ReplyPort && !req->sigmask){
+		req->result = SPI_ERR_PARAM;
+		req->msg.mn_Node.ln_Type = NT_REPLYMSG;
+		return;
+	}
+	req->msg.mn_Node.ln_Type = NT_MESSAGE;
+	PutMsg(req->queue->port, &req->msg);
+}
+
+BOOL spi_request_done(struct SpiRequest *req)
+{
+	return req->msg.mn_Node.ln_Type == NT_REPLYMSG;
+}
+
+LONG spi_wait_request(struct SpiRequest *req)
+{
+	struct MsgPort *port = req->msg.mn_ReplyPort;
+
+	if (port){
+		// Take this request off the reply port, leave any others queued
+		while (!spi_request_done(req)){
+			Wait(1L << port->mp_SigBit);
+		}
+		Forbid();
+		Remove(&req->msg.mn_Node);
+		Permit();
+	}else{
+		while (!spi_request_done(req)){
+			Wait(req->sigmask);
+		}
+	}
+	return req->result;
+}
@@ -0,0 +1,48 @@
+/*
+ * Asynchronous transfer queue for spiderdev.lib
+ * A server task runs submitted transactions so the caller does not
+ * busy-poll the FIFO for the duration of a transfer.
+ */
+#ifndef SPI_QUEUE_H_
+#define SPI_QUEUE_H_
+
+#include <exec/types.h>
+#include <exec/ports.h>
+
+#include "spi.h"
+
+struct SpiQueue;
+
+struct SpiRequest
+{
+	struct Message msg;					// Set mn_ReplyPort to get the request back with ReplyMsg
+	struct SpiQueue *queue;
+	struct Task *task;					// Signalled with sigmask on completion when there is no reply port
+	ULONG sigmask;						// The queue's own signal for its creator, otherwise 0 until set
+	const struct SpiSegment *segs;		// Transaction to run, must stay valid until completion
+	int count;
+	LONG result;						// spi_transaction() result
+};
+
+// Creates the server task for ctrl with pool_size preallocated requests. pri is the
+// server task priority. Returns NULL on failure. The server signals the creating task
+// when it starts and stops, so spi_queue_delete() must be called from that task.
+struct SpiQueue *spi_queue_create(struct SpiController *ctrl, int pool_size, LONG pri);
+// Stops the server task once queued requests have run and frees the pool
+void spi_queue_delete(struct SpiQueue *q);
+// Takes a request from the pool, NULL if all are in use. No memory is allocated.
+// Unless a reply port is set it completes by signalling the calling task. The queue
+// allocates a signal for the task that created it, other tasks must set a reply port
+// or sigmask to a signal they allocated. Never use SIGF_SINGLE, semaphores wait on it.
+struct SpiRequest *spi_alloc_request(struct SpiQueue *q);
+// Returns a completed request to the pool
+void spi_free_request(struct SpiRequest *req);
+// Queue the request. Returns immediately, completion is by ReplyMsg or Signal.
+// A request with neither completes at once with SPI_ERR_PARAM.
+void spi_submit(struct SpiRequest *req);
+// TRUE once the server has finished with the request
+BOOL spi_request_done(struct SpiRequest *req);
+// Blocks until the request completes and returns its result
+LONG spi_wait_request(struct SpiRequest *req);
+
+#endif
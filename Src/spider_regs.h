@@ -0,0 +1,67 @@
+/*
+ * SPIder firmware register map and clockport access for spiderdev.lib
+ * Build with SPI_HOST_SIM defined to route every register access through
+ * the simulated board in Host/spisim.c instead of the real clockport.
+ */
+#ifndef SPIDER_REGS_H_
+#define SPIDER_REGS_H_
+
+#include <exec/types.h>
+
+#define REG_STATUS          	0	// RO
+#define REG_RESERVED_1          1
+#define REG_UPPER_LENGTH        2   // WO, Upper byte for lengths
+#define REG_GPIOS 		        3   // RO, Read GPIO values 20-27
+#define REG_RESET				4	// WO, Set value of pin 29
+#define REG_RX_HEAD             4   // RO
+#define REG_RX_TAIL             5   // RO
+#define REG_TX_HEAD             6   // RO
+#define REG_TX_TAIL             7   // RO
+#define REG_RX_DISCARD          8   // WO, Lower byte
+#define REG_TX_FEED             9   // WO, Lower byte
+#define REG_SPI_FREQ            10  // WO, Set SPI frequency
+#define REG_SLAVE_SELECT        11  // WO, Write SS
+#define REG_INT_FIRED           12  // RW
+#define REG_INT_ARMED           13  // WO
+#define REG_FIFO                14  // RW, Write to TX, Read from RX
+#define REG_IDENT               15  // RO
+
+#define SPIDER_REG_COUNT        16
+
+#define STATUS_RX_DISCARD_EMPTY 0x01
+
+#define IDENT_SIZE              8
+
+#define CP_REG(cp, reg)         ((volatile UBYTE *)((cp) + ((reg) << 2)))
+
+// Clockport addresses are kept as ULONG, which is narrower than a pointer on the host
+#ifdef SPI_HOST_SIM
+#include <stdint.h>
+#define CP_ADDR(addr)           ((volatile UBYTE *)(uintptr_t)(addr))
+#define PTR_BITS(ptr)           ((ULONG)(uintptr_t)(ptr))
+#else
+#define CP_ADDR(addr)           ((volatile UBYTE *)(addr))
+#define PTR_BITS(ptr)           ((ULONG)(ptr))
+#endif
+
+#ifdef SPI_HOST_SIM
+
+#include "spisim.h"
+
+#define CP_WR(cp, reg, val)     spisim_write(CP_REG((cp), (reg)), (val))
+#define CP_RD(cp, reg)          spisim_read(CP_REG((cp), (reg)))
+#define FIFO_WR(fifo, val)      spisim_write((fifo), (val))
+#define FIFO_RD(fifo)           spisim_read((fifo))
+#define CPU_SPIN(n)             spisim_spin((n))
+
+#else
+
+#define CP_WR(cp, reg, val)     (*CP_REG((cp), (reg)) = (val))
+#define CP_RD(cp, reg)          (*CP_REG((cp), (reg)))
+#define FIFO_WR(fifo, val)      (*(fifo) = (val))
+#define FIFO_RD(fifo)           (*(fifo))
+#define CPU_SPIN(n)             { volatile ULONG spin_ = (n); while (spin_) spin_--; }
+
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Timer wheel multiplexing many timeouts onto one timer.device request
+ */
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/io.h>
+#include <devices/timer.h>
+
+#include <proto/exec.h>
+#include <clib/alib_protos.h>
+
+#include "timer_service.h"
+#include "timing.h"
+#include "debug.h"
+
+#define WHEEL_MASK		(TIMER_WHEEL_SLOTS - 1)
+
+struct TimerService
+{
+	struct IORequest *tmr;
+	BOOL pending;			// tmr is with timer.device
+	ULONG due;				// tick tmr is set for while pending
+	ULONG tick_us;
+	ULONG tick;				// wheel position, slots up to here have been run
+	ULONG last_us;			// timer_micros() at the start of tick
+	ULONG count;			// entries armed
+	struct MinList wheel[TIMER_WHEEL_SLOTS];
+};
+
+// Whole ticks gone since ts->tick
+static ULONG elapsed_ticks(struct TimerService *ts)
+{
+	return (timer_micros() - ts->last_us) / ts->tick_us;
+}
+
+// Earliest expiry of the armed entries. Only run when the request completes,
+// not on every tick.
+static ULONG earliest_due(struct TimerService *ts)
+{
+	struct TimerEntry *te = NULL;
+	ULONG due = 0;
+	BOOL found = FALSE;
+	int i = 0;
+
+	for (; i < TIMER_WHEEL_SLOTS; i++){
+		te = (struct TimerEntry *)ts->wheel[i].mlh_Head;
+		for (; te->node.mln_Succ; te = (struct TimerEntry *)te->node.mln_Succ){
+			if (!found || (LONG)(te->expires - due) < 0){
+				due = te->expires;
+				found = TRUE;
+			}
+		}
+	}
+	return due;
+}
+
+// Wake up at the boundary of tick due. Far off ticks are reached in steps,
+// the dispatch on the way finds nothing and sends the request again.
+static void start_request(struct TimerService *ts, ULONG due)
+{
+	ULONG ticks = due - ts->tick, gone = timer_micros() - ts->last_us, us = 0;
+
+	if ((LONG)ticks < 1){
+		ticks = 1;
+	}
+	if (ticks > 0x7FFFFFFFUL / ts->tick_us){
+		ticks = 0x7FFFFFFFUL / ts->tick_us;
+	}
+	us = ticks * ts->tick_us;
+	us = us > gone ? us - gone : 1;
+
+	ts->due = due;
+	ts->tmr->io_Command = TR_ADDREQUEST;
+	((struct timerequest *)ts->tmr)->tr_time.tv_secs = us / 1000000UL;
+	((struct timerequest *)ts->tmr)->tr_time.tv_micro = us % 1000000UL;
+	SendIO(ts->tmr);
+	ts->pending = TRUE;
+}
+
+struct TimerService *timer_service_create(ULONG tick_us)
+{
+	struct TimerService *ts = NULL;
+	int i = 0;
+
+	if (!tick_us){
+		return NULL;
+	}
+	if (!(ts = AllocMem(sizeof(struct TimerService), MEMF_PUBLIC | MEMF_CLEAR))){
+		return NULL;
+	}
+	if (!timer_clock_open()){
+		FreeMem(ts, sizeof(struct TimerService));
+		return NULL;
+	}
+	if (!(ts->tmr = openTimer())){
+		D(DebugPrint(ERROR_LEVEL,"timer_service_create: no timer\n"));
+		timer_clock_close();
+		FreeMem(ts, sizeof(struct TimerService));
+		return NULL;
+	}
+	for (; i < TIMER_WHEEL_SLOTS; i++){
+		NewList((struct List *)&ts->wheel[i]);
+	}
+	ts->tick_us = tick_us;
+	ts->last_us = timer_micros();
+	return ts;
+}
+
+void timer_service_delete(struct TimerService *ts)
+{
+	struct MinNode *n = NULL;
+	int i = 0;
+
+	if (!ts){
+		return;
+	}
+	if (ts->pending){
+		AbortIO(ts->tmr);
+		WaitIO(ts->tmr);
+	}
+	for (; i < TIMER_WHEEL_SLOTS; i++){
+		while ((n = (struct MinNode *)RemHead((struct List *)&ts->wheel[i]))){
+			((struct TimerEntry *)n)->armed = FALSE;
+		}
+	}
+	timerCloseTimer(ts->tmr);
+	timer_clock_close();
+	FreeMem(ts, sizeof(struct TimerService));
+}
+
+ULONG timer_service_signal(struct TimerService *ts)
+{
+	return 1L << ts->tmr->io_Message.mn_ReplyPort->mp_SigBit;
+}
+
+void timer_service_dispatch(struct TimerService *ts)
+{
+	struct MinList expired;
+	struct TimerEntry *te = NULL, *next = NULL;
+	ULONG ticks = 0, target = 0, slots = 0, i = 0;
+
+	if (ts->pending && CheckIO(ts->tmr)){
+		WaitIO(ts->tmr);
+		ts->pending = FALSE;
+	}
+
+	ticks = elapsed_ticks(ts);
+	ts->last_us += ticks * ts->tick_us;
+	target = ts->tick + ticks;
+
+	// Every slot only needs visiting once however far behind we are. Entries
+	// more than a revolution away share slots with nearer ones and stay put.
+	NewList((struct List *)&expired);
+	slots = ticks < TIMER_WHEEL_SLOTS ? ticks : TIMER_WHEEL_SLOTS;
+	for (i = 1; i <= slots; i++){
+		te = (struct TimerEntry *)ts->wheel[(ts->tick + i) & WHEEL_MASK].mlh_Head;
+		for (; (next = (struct TimerEntry *)te->node.mln_Succ); te = next){
+			if ((LONG)(te->expires - target) <= 0){
+				Remove((struct Node *)&te->node);
+				AddTail((struct List *)&expired, (struct Node *)&te->node);
+			}
+		}
+	}
+	ts->tick = target;
+
+	// Callbacks may arm or cancel anything, including entries still in expired
+	while ((te = (struct TimerEntry *)RemHead((struct List *)&expired))){
+		te->armed = FALSE;
+		ts->count--;
+		te->func(te, te->data);
+	}
+
+	if (ts->count && !ts->pending){
+		start_request(ts, earliest_due(ts));
+	}
+}
+
+void timer_entry_init(struct TimerEntry *te, TIMER_FUNC func, APTR data)
+{
+	te->armed = FALSE;
+	te->func = func;
+	te->data = data;
+}
+
+void timer_arm(struct TimerService *ts, struct TimerEntry *te, ULONG us)
+{
+	ULONG ticks = us / ts->tick_us + (us % ts->tick_us != 0);
+
+	if (te->armed){
+		Remove((struct Node *)&te->node);
+	}else{
+		ts->count++;
+	}
+	if (!ticks){
+		ticks = 1;
+	}
+	// ts->tick is behind the clock until the next dispatch
+	te->expires = ts->tick + elapsed_ticks(ts) + ticks;
+	AddTail((struct List *)&ts->wheel[te->expires & WHEEL_MASK], (struct Node *)&te->node);
+	te->armed = TRUE;
+
+	// Only touched when this entry is due before the request
+	if (ts->pending && (LONG)(te->expires - ts->due) < 0){
+		AbortIO(ts->tmr);
+		WaitIO(ts->tmr);
+		// No wakeup for the aborted request, the port is only used by it
+		SetSignal(0, timer_service_signal(ts));
+		ts->pending = FALSE;
+	}
+	if (!ts->pending){
+		start_request(ts, te->expires);
+	}
+}
+
+void timer_cancel(struct TimerService *ts, struct TimerEntry *te)
+{
+	if (te->armed){
+		Remove((struct Node *)&te->node);
+		te->armed = FALSE;
+		ts->count--;
+	}
+}
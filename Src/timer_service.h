@@ -0,0 +1,58 @@
+#ifndef __TIMER_SERVICE_H
+#define __TIMER_SERVICE_H
+
+#include <exec/types.h>
+#include <exec/lists.h>
+#include <exec/nodes.h>
+
+/*
+ * Many logical timeouts on one timer.device request. Entries sit in a
+ * hashed timer wheel, so arming and cancelling are a list insert and a
+ * list remove whatever the number of entries. The single request is set
+ * for the earliest expiry, so the task only wakes when something is due.
+ *
+ * A service belongs to one task. Wait on timer_service_signal() and call
+ * timer_service_dispatch() when it arrives, expired entries have their
+ * callbacks run from there.
+ */
+
+#ifndef TIMER_WHEEL_SLOTS
+#define TIMER_WHEEL_SLOTS		64	// power of 2
+#endif
+
+struct TimerEntry;
+
+typedef void (*TIMER_FUNC)(struct TimerEntry *te, APTR data);
+
+struct TimerEntry
+{
+	struct MinNode node;	// in a wheel slot while armed
+	ULONG expires;			// service tick it is due on
+	BOOL armed;
+	TIMER_FUNC func;
+	APTR data;
+};
+
+struct TimerService;
+
+/*!
+ * Creates a service with a resolution of tick_us microseconds. Timeouts
+ * are rounded up to whole ticks and run up to a tick late.
+ *
+ * \return				NULL if the timer or memory could not be had
+ */
+struct TimerService *timer_service_create(ULONG tick_us);
+// Cancels everything still armed, callbacks are not run
+void timer_service_delete(struct TimerService *ts);
+// Signal mask to Wait() on
+ULONG timer_service_signal(struct TimerService *ts);
+// Runs the callbacks of expired entries and re-arms the timer request
+void timer_service_dispatch(struct TimerService *ts);
+
+void timer_entry_init(struct TimerEntry *te, TIMER_FUNC func, APTR data);
+// Calls func after us microseconds. An armed entry is moved to the new time.
+void timer_arm(struct TimerService *ts, struct TimerEntry *te, ULONG us);
+// Harmless if te is not armed
+void timer_cancel(struct TimerService *ts, struct TimerEntry *te);
+
+#endif
@@ -1,12 +1,28 @@
 #include "timing.h"
 #include "debug.h"
+#include "trace.h"
 
+#include <exec/execbase.h>
+#include <dos/dos.h>
+#include <dos/var.h>
+#include <proto/dos.h>
+#include <clib/alib_protos.h>
+
+#ifdef SPI_HOST_SIM
+#include "spisim.h"
+#endif
+
+#ifndef SPI_HOST_SIM
 static volatile UBYTE * const todl = (volatile UBYTE*)0xbfe801;
 static volatile UBYTE * const todm = (volatile UBYTE*)0xbfe901;
 static volatile UBYTE * const todh = (volatile UBYTE*)0xbfea01;
+#endif
 
 ULONG timer_get_tick_count(void)
 {
+#ifdef SPI_HOST_SIM
+	return spisim_tod_ticks();
+#else
 	UBYTE l,m,h;
 
 	/* TOD registers latch on reading MSB, unlatch on reading LSB */
@@ -14,6 +30,7 @@ ULONG timer_get_tick_count(void)
 	m = *todm;
 	l = *todl;
 	return ((ULONG)h << 16) | ((ULONG)m << 8) | (ULONG)l;
+#endif
 }
 
 void timer_delay(ULONG ticks)
@@ -24,27 +41,159 @@ void timer_delay(ULONG ticks)
 	}
 }
 
-BOOL timerCalibrate(struct IORequest* tmr, ULONG *itersPer400ns)
+// The microsecond clock keeps timer.device open on a request that is never
+// sent, only its io_Device is used for ReadEClock().
+static struct timerequest clock_req;
+static struct Device *clock_timer;
+static UWORD clock_users;
+static ULONG us_whole;	// 1000000 / EClock frequency, integer part
+static ULONG us_frac;	// and the fraction as 0.32 fixed point
+
+BOOL timer_clock_open(void)
+{
+	struct Device *TimerBase = NULL;
+	struct EClockVal ev;
+	ULONG freq = 0, rem = 0, frac = 0;
+	int i = 0;
+
+	Forbid();
+	if (!clock_users){
+		if (OpenDevice("timer.device", UNIT_ECLOCK, (struct IORequest *)&clock_req, 0) != 0){
+			Permit();
+			D(DebugPrint(ERROR_LEVEL,"Failed to open ECLOCK timer.device\n"));
+			return FALSE;
+		}
+		TimerBase = clock_req.tr_node.io_Device;
+		freq = ReadEClock(&ev);
+
+		// Work out 10^6 / freq once so conversions need no division
+		us_whole = 1000000UL / freq;
+		rem = 1000000UL % freq;
+		for (; i < 32; i++){
+			rem <<= 1;
+			frac <<= 1;
+			if (rem >= freq){
+				rem -= freq;
+				frac |= 1;
+			}
+		}
+		us_frac = frac;
+		clock_timer = TimerBase;
+	}
+	clock_users++;
+	Permit();
+	return TRUE;
+}
+
+void timer_clock_close(void)
+{
+	Forbid();
+	if (clock_users && --clock_users == 0){
+		clock_timer = NULL;
+		CloseDevice((struct IORequest *)&clock_req);
+	}
+	Permit();
+}
+
+// hi:lo = a * b from 16 bit products, which is all the 68000 has
+static void mul_32x32(ULONG a, ULONG b, ULONG *hi, ULONG *lo)
+{
+	ULONG al = a & 0xFFFF, ah = a >> 16, bl = b & 0xFFFF, bh = b >> 16;
+	ULONG ll = al * bl, lh = al * bh, hl = ah * bl;
+	ULONG mid = (ll >> 16) + (lh & 0xFFFF) + (hl & 0xFFFF);
+
+	*lo = (mid << 16) | (ll & 0xFFFF);
+	*hi = ah * bh + (lh >> 16) + (hl >> 16) + (mid >> 16);
+}
+
+void timer_get_micros(struct TimerMicros *t)
+{
+	struct Device *TimerBase = clock_timer;
+	struct EClockVal ev;
+	ULONG hi = 0, lo = 0, carry = 0, part = 0;
+
+	ReadEClock(&ev);
+
+	// ticks * whole + (ticks * frac) >> 32, nothing kept between calls
+	mul_32x32(ev.ev_lo, us_frac, &carry, &part);
+	mul_32x32(ev.ev_hi, us_frac, &hi, &lo);
+	lo += carry;
+	if (lo < carry){
+		hi++;
+	}
+	mul_32x32(ev.ev_lo, us_whole, &carry, &part);
+	hi += carry + ev.ev_hi * us_whole;
+	lo += part;
+	if (lo < part){
+		hi++;
+	}
+	t->hi = hi;
+	t->lo = lo;
+}
+
+ULONG timer_micros(void)
+{
+	struct TimerMicros t;
+
+	timer_get_micros(&t);
+	return t.lo;
+}
+
+void timer_spin_us(ULONG us)
+{
+	ULONG deadline = timer_micros() + us;
+
+	while ((LONG)(timer_micros() - deadline) < 0){
+	}
+}
+
+void timer_delay_us(struct IORequest *tmr, ULONG us)
+{
+	ULONG deadline = timer_micros() + us, sleep = 0;
+
+	if (tmr && us > 2 * TIMER_SLEEP_SLACK_US){
+		sleep = us - TIMER_SLEEP_SLACK_US;
+		timerWaitTO(tmr, sleep / 1000000UL, sleep % 1000000UL, 0);
+	}
+	while ((LONG)(timer_micros() - deadline) < 0){
+	}
+}
+
+// Runs without Forbid() take the shortest of this many, other tasks only add time
+#define CALIBRATE_RUNS			4
+
+static BOOL calibrate(struct IORequest* tmr, ULONG *itersPer400ns, BOOL forbid)
 {
     register ULONG x;
     register ULONG scale = 0x8000;      // min iterations...
     volatile register ULONG t = 1;
-    struct timeval t1, t2;
+    struct timeval t1, t2, best;
     struct Device *TimerBase = tmr->io_Device;
+	int run = 0;
 	
 	*itersPer400ns = 0 ;
     
     while (scale < 0x80000000){
-        Forbid();
-        GetSysTime(&t1);
-        for (x = 1; x < scale; x++){
-            t = (((t + x) * t) - x) / x;    // add, mul, sub, div, trivial benchmark.
-			//hwDelay() ;
-		}
+		for (run = 0; run < (forbid ? 1 : CALIBRATE_RUNS); run++){
+			if (forbid){
+				Forbid();
+			}
+			GetSysTime(&t1);
+			for (x = 1; x < scale; x++){
+				t = (((t + x) * t) - x) / x;    // add, mul, sub, div, trivial benchmark.
+				//hwDelay() ;
+			}
 
-        GetSysTime(&t2);
-        Permit();
-        SubTime(&t2, &t1);
+			GetSysTime(&t2);
+			if (forbid){
+				Permit();
+			}
+			SubTime(&t2, &t1);
+			if (run == 0 || CmpTime(&t2, &best) > 0){
+				best = t2;
+			}
+		}
+		t2 = best;
 		D(DebugPrint(DEBUG_LEVEL,"SubTime on calibration: sec = %u, micro = %u, scale = 0X%04X\n", t2.tv_secs, t2.tv_micro, scale)) ;
         
         // Cannot be over 1 second, this will not work - slow system
@@ -74,6 +223,172 @@ BOOL timerCalibrate(struct IORequest* tmr, ULONG *itersPer400ns)
     return TRUE;
 }
 
+BOOL timerCalibrate(struct IORequest* tmr, ULONG *itersPer400ns)
+{
+	return calibrate(tmr, itersPer400ns, TRUE);
+}
+
+// Calibration cache, a binary ENV: variable. probe tells CPU clock changes
+// apart when AttnFlags and the EClock are the same.
+#define TIMER_CAL_MAGIC			0x54434131	// 'TCA1'
+#define TIMER_PROBE_ITERS		128
+#define REFRESH_STACK_SIZE		4096
+
+struct TimerCalCache
+{
+	ULONG magic;
+	UWORD attn;
+	UWORD pad;
+	ULONG eclock;
+	ULONG probe;
+	ULONG iters;
+};
+
+static const char refresh_name[] = "spi-lib-spider calibrate";
+
+static struct Task *refresh_task;
+static struct Task *refresh_creator;
+static BYTE refresh_sig = -1;
+static BOOL refresh_ok;
+static ULONG refresh_iters;
+static struct TimerCalCache refresh_key;
+
+// EClock ticks for a short run of the calibration loop
+static ULONG timer_probe(struct Device *TimerBase)
+{
+    register ULONG x;
+    volatile register ULONG t = 1;
+	struct EClockVal e1, e2;
+
+	Forbid();
+	ReadEClock(&e1);
+	for (x = 1; x < TIMER_PROBE_ITERS; x++){
+		t = (((t + x) * t) - x) / x;
+	}
+	ReadEClock(&e2);
+	Permit();
+	return e2.ev_lo - e1.ev_lo;
+}
+
+static void timer_cal_key(struct IORequest *tmr, struct TimerCalCache *key)
+{
+	struct Device *TimerBase = tmr->io_Device;
+	struct EClockVal ev;
+	ULONG probe = 0;
+
+	key->magic = TIMER_CAL_MAGIC;
+	key->attn = SysBase->AttnFlags;
+	key->pad = 0;
+	key->eclock = ReadEClock(&ev);
+	// Best of two so an interrupt during one run does not count
+	key->probe = timer_probe(TimerBase);
+	if ((probe = timer_probe(TimerBase)) < key->probe){
+		key->probe = probe;
+	}
+	key->iters = 0;
+}
+
+// GetVar()/SetVar() need a process
+static BOOL can_use_dos(void)
+{
+	return FindTask(NULL)->tc_Node.ln_Type == NT_PROCESS;
+}
+
+static void timer_cal_save(const struct TimerCalCache *cache)
+{
+    struct DosLibrary *DOSBase = NULL;
+
+	if (can_use_dos() && (DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 36))){
+		// GVF_SAVE_VAR writes ENVARC: as well
+		if (!SetVar(TIMER_CAL_VAR, (char *)cache, sizeof(struct TimerCalCache), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_SAVE_VAR)){
+			D(DebugPrint(ERROR_LEVEL,"Cannot save %s\n", TIMER_CAL_VAR));
+		}
+		CloseLibrary((struct Library *)DOSBase);
+	}
+}
+
+static BOOL timer_cal_load(struct TimerCalCache *cache)
+{
+    struct DosLibrary *DOSBase = NULL;
+	LONG len = -1;
+
+	if (can_use_dos() && (DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 36))){
+		len = GetVar(TIMER_CAL_VAR, (char *)cache, sizeof(struct TimerCalCache), GVF_GLOBAL_ONLY | GVF_BINARY_VAR | GVF_DONT_NULL_TERM);
+		CloseLibrary((struct Library *)DOSBase);
+	}
+	return len == sizeof(struct TimerCalCache) && cache->magic == TIMER_CAL_MAGIC;
+}
+
+// Plain task, no DOS here. timerCalibrateEnd() saves the result.
+// Runs at low priority without Forbid() so it never holds up other tasks.
+static void __saveds refresh_server(void)
+{
+	struct IORequest *tmr = NULL;
+
+	if ((tmr = openTimer())){
+		refresh_ok = calibrate(tmr, &refresh_iters, FALSE);
+		timerCloseTimer(tmr);
+	}
+
+	// Keep the creator from going on until this task has gone
+	Forbid();
+	Signal(refresh_creator, 1L << refresh_sig);
+}
+
+BOOL timerCalibrateCached(struct IORequest *tmr, ULONG *itersPer400ns, ULONG flags)
+{
+	struct TimerCalCache key, cache;
+	ULONG slack = 0;
+	BOOL ok = TRUE;
+
+	timer_cal_key(tmr, &key);
+	slack = key.probe / 8 + 1;
+
+	if (timer_cal_load(&cache) && cache.attn == key.attn && cache.eclock == key.eclock &&
+		cache.probe + slack >= key.probe && cache.probe <= key.probe + slack && cache.iters){
+		*itersPer400ns = cache.iters;
+		D(DebugPrint(DEBUG_LEVEL,"Calibration from %s: %lu iterations per 400ns\n", TIMER_CAL_VAR, cache.iters));
+
+		if ((flags & TIMER_CAL_REFRESH) && !refresh_task){
+			refresh_key = cache;
+			refresh_creator = FindTask(NULL);
+			if ((refresh_sig = AllocSignal(-1)) >= 0){
+				SetSignal(0, 1L << refresh_sig);
+				// Below normal tasks so it only runs when the machine is idle
+				if (!(refresh_task = CreateTask(refresh_name, -10, (APTR)refresh_server, REFRESH_STACK_SIZE))){
+					FreeSignal(refresh_sig);
+					refresh_sig = -1;
+				}
+			}
+		}
+		return TRUE;
+	}
+
+	ok = timerCalibrate(tmr, itersPer400ns);
+	if (ok){
+		key.iters = *itersPer400ns;
+		timer_cal_save(&key);
+	}
+	return ok;
+}
+
+void timerCalibrateEnd(void)
+{
+	if (!refresh_task){
+		return;
+	}
+	Wait(1L << refresh_sig);
+	FreeSignal(refresh_sig);
+	refresh_sig = -1;
+	refresh_task = NULL;
+
+	if (refresh_ok && refresh_iters != refresh_key.iters){
+		D(DebugPrint(DEBUG_LEVEL,"Calibration changed from %lu to %lu iterations per 400ns\n", refresh_key.iters, refresh_iters));
+		refresh_key.iters = refresh_iters;
+		timer_cal_save(&refresh_key);
+	}
+}
+
 __inline void timerWait400ns(ULONG itersPer400ns)
 {
     volatile register ULONG t = 1;
@@ -116,8 +431,13 @@ __inline ULONG waitTO(struct IORequest* tmr, ULONG sigs)
 
 __inline ULONG timerWaitTO(struct IORequest* tmr, ULONG secs, ULONG micro, ULONG sigs)
 {
+	ULONG got = 0;
+
+	TRACE(TRACE_WAIT_BEGIN, secs, micro);
 	setTimer(tmr, secs, micro);
-    return waitTO(tmr,sigs);
+	got = waitTO(tmr,sigs);
+	TRACE(TRACE_WAIT_END, got, sigs);
+	return got;
 }
 
 struct IORequest *openTimer(void)
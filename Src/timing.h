@@ -34,6 +34,48 @@
 ULONG timer_get_tick_count(void);
 void timer_delay(ULONG ticks);
 
+/*! Microsecond clock from the EClock, 64 bits as SAS/C has no long long */
+struct TimerMicros
+{
+	ULONG hi;
+	ULONG lo;
+};
+
+#ifndef TIMER_SLEEP_SLACK_US
+/*! Spin-then-sleep delays wake this long before the deadline and spin the rest */
+#define TIMER_SLEEP_SLACK_US	1000
+#endif
+
+/*!
+ * Opens the EClock for the microsecond clock. Counted, every successful
+ * call needs a timer_clock_close(). Call from a task, not an interrupt.
+ *
+ * \return				FALSE if timer.device could not be opened
+ */
+BOOL timer_clock_open(void);
+void timer_clock_close(void);
+
+/*!
+ * Monotonic microseconds since the EClock started. Safe from interrupts
+ * once timer_clock_open() has succeeded.
+ */
+void timer_get_micros(struct TimerMicros *t);
+
+/*!
+ * Low 32 bits of timer_get_micros(), wraps after 71 minutes. Compare
+ * with (LONG)(a - b) for deadlines up to 35 minutes away.
+ */
+ULONG timer_micros(void);
+
+/*! Busy waits for us microseconds, usable with interrupts disabled */
+void timer_spin_us(ULONG us);
+
+/*!
+ * Waits us microseconds, sleeping on tmr for all but TIMER_SLEEP_SLACK_US
+ * and spinning the rest so the wakeup is not late. Short waits only spin.
+ */
+void timer_delay_us(struct IORequest *tmr, ULONG us);
+
 // Setup and sendio the timer request
 void setTimer(struct IORequest* tmr, ULONG secs, ULONG micro);
 // wait on timer to complete or another signal to complete - returns completed signal or zero if timer expired
@@ -49,4 +91,25 @@ void timerWait400ns(ULONG itersPer400ns);
 // Run timerCalibrate before timerWait400ns. itersPer400ns should be used for timerWait400ns. 
 BOOL timerCalibrate(struct IORequest* tmr, ULONG *itersPer400ns);
 
+/*! ENV: variable holding the last calibration, saved to ENVARC: too */
+#define TIMER_CAL_VAR			"spider-timing"
+
+/*! timerCalibrateCached() flag: recalibrate in a background task after a cache hit */
+#define TIMER_CAL_REFRESH		1
+
+/*!
+ * timerCalibrate() result from TIMER_CAL_VAR when it was saved on the
+ * same CPU, FPU, EClock and CPU speed, otherwise calibrates and saves it.
+ * DOS is used for the variable, from a plain task it always calibrates.
+ *
+ * \return				FALSE if calibration ran and failed
+ */
+BOOL timerCalibrateCached(struct IORequest *tmr, ULONG *itersPer400ns, ULONG flags);
+
+/*!
+ * Waits for a TIMER_CAL_REFRESH task and saves what it measured if it
+ * differs. Must be called before the program exits if the flag was used.
+ */
+void timerCalibrateEnd(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "trace.h"
+
+#ifdef SPI_TRACE
+
+#include <exec/types.h>
+#include <devices/timer.h>
+#include <dos/dos.h>
+
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <proto/timer.h>
+
+#define TRACE_MASK		(TRACE_RING - 1)
+
+static struct TraceRecord trace_ring[TRACE_RING];
+static ULONG trace_count;			// records ever written, the next goes at trace_count & TRACE_MASK
+static ULONG trace_freq;
+static struct Device *trace_timer;	// NULL when not recording
+
+void trace_start(struct IORequest *tmr)
+{
+	struct Device *TimerBase = tmr->io_Device;
+	struct EClockVal ev;
+
+	Disable();
+	trace_count = 0;
+	trace_freq = ReadEClock(&ev);
+	trace_timer = TimerBase;
+	Enable();
+}
+
+void trace_stop(void)
+{
+	trace_timer = NULL;
+}
+
+void trace_point(UWORD event, ULONG arg1, ULONG arg2)
+{
+	struct Device *TimerBase = trace_timer;
+	struct TraceRecord *rec = NULL;
+	struct EClockVal ev;
+
+	if (!TimerBase){
+		return;
+	}
+	ReadEClock(&ev);
+
+	// Interrupts record too, so claim the slot and fill it in one go
+	Disable();
+	rec = &trace_ring[trace_count & TRACE_MASK];
+	rec->eclock = ev.ev_lo;
+	rec->event = event;
+	rec->seq = (UWORD)trace_count;
+	rec->arg1 = arg1;
+	rec->arg2 = arg2;
+	trace_count++;
+	Enable();
+}
+
+static UBYTE *put_uword(UBYTE *p, UWORD v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static UBYTE *put_ulong(UBYTE *p, ULONG v)
+{
+	*p++ = v >> 24;
+	*p++ = v >> 16;
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+LONG trace_dump(const char *path)
+{
+	struct Device *timer = trace_timer;
+	UBYTE buf[sizeof(struct TraceRecord) * 16], *p = buf;
+	ULONG count = 0, first = 0, i = 0;
+	const struct TraceRecord *rec = NULL;
+	BOOL ok = TRUE;
+	BPTR f = 0;
+	struct DosLibrary *DOSBase = (struct DosLibrary *)OpenLibrary(DOSNAME, 0);
+
+	if (!DOSBase){
+		return -1;
+	}
+	if (!(f = Open((STRPTR)path, MODE_NEWFILE))){
+		CloseLibrary((struct Library *)DOSBase);
+		return -1;
+	}
+
+	// Recording pauses while the ring is written out
+	trace_timer = NULL;
+	count = trace_count < TRACE_RING ? trace_count : TRACE_RING;
+	first = trace_count - count;
+
+	p = put_ulong(p, TRACE_MAGIC);
+	p = put_uword(p, TRACE_VERSION);
+	p = put_uword(p, sizeof(struct TraceRecord));
+	p = put_ulong(p, trace_freq);
+	p = put_ulong(p, count);
+	p = put_ulong(p, first);
+	ok = Write(f, buf, p - buf) == p - buf;
+
+	for (p = buf; ok && i < count; i++){
+		rec = &trace_ring[(first + i) & TRACE_MASK];
+		p = put_ulong(p, rec->eclock);
+		p = put_uword(p, rec->event);
+		p = put_uword(p, rec->seq);
+		p = put_ulong(p, rec->arg1);
+		p = put_ulong(p, rec->arg2);
+		if (p == buf + sizeof(buf) || i + 1 == count){
+			ok = Write(f, buf, p - buf) == p - buf;
+			p = buf;
+		}
+	}
+
+	Close(f);
+	CloseLibrary((struct Library *)DOSBase);
+	trace_timer = timer;
+	return ok ? (LONG)count : -1;
+}
+
+#endif
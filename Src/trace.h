@@ -0,0 +1,76 @@
+#ifndef __SPI_TRACE_H
+#define __SPI_TRACE_H
+
+#include <exec/types.h>
+#include <exec/io.h>
+
+/*
+ * Binary trace points for the transfer paths. Build with SPI_TRACE defined
+ * to record them, otherwise TRACE() expands to nothing and trace.c is empty.
+ *
+ * Each point stores a 16 byte record in a ring: the low 32 bits of the
+ * EClock, the event id and two arguments. Nothing is formatted on the
+ * Amiga, trace_dump() writes the ring to a file for Host/spitrace to decode.
+ */
+
+// Event ids are stored in dumps, only ever add to the end
+#define TRACE_READ_BEGIN	1	// a1 length, a2 controller
+#define TRACE_READ_END		2	// a1 result, a2 controller
+#define TRACE_WRITE_BEGIN	3	// a1 length, a2 controller
+#define TRACE_WRITE_END		4	// a1 result, a2 controller
+#define TRACE_XFER_BEGIN	5	// a1 length, a2 controller
+#define TRACE_XFER_END		6	// a1 result, a2 controller
+#define TRACE_SELECT		7	// a1 select mask, a2 controller
+#define TRACE_DESELECT		8	// a1 0, a2 controller
+#define TRACE_INTERRUPT		9	// a1 REG_INT_FIRED, a2 pins taken
+#define TRACE_WAIT_BEGIN	10	// a1 secs, a2 micro
+#define TRACE_WAIT_END		11	// a1 signals returned, a2 wait mask
+#define TRACE_USER			0x8000	// first id free for applications
+
+#ifndef TRACE_RING
+#define TRACE_RING			1024	// records, power of 2
+#endif
+
+struct TraceRecord
+{
+	ULONG eclock;		// low 32 bits of ReadEClock()
+	UWORD event;
+	UWORD seq;			// running count, shows where the ring wrapped
+	ULONG arg1;
+	ULONG arg2;
+};
+
+// Dump file layout, all fields big endian: header then count records
+#define TRACE_MAGIC			0x53505452	// 'SPTR'
+#define TRACE_VERSION		1
+
+struct TraceHeader
+{
+	ULONG magic;
+	UWORD version;
+	UWORD record_size;
+	ULONG eclock_freq;
+	ULONG count;		// records that follow, oldest first
+	ULONG lost;			// records overwritten before the dump
+};
+
+#ifdef SPI_TRACE
+
+#define TRACE(ev, a1, a2)	trace_point((ev), (ULONG)(a1), (ULONG)(a2))
+
+// Empty the ring and start recording, timestamps come from tmr's timer.device
+void trace_start(struct IORequest *tmr);
+// Stop recording, the ring is kept for trace_dump()
+void trace_stop(void);
+// Record one event, safe from interrupts
+void trace_point(UWORD event, ULONG arg1, ULONG arg2);
+// Write the ring to path, returns the number of records or -1
+LONG trace_dump(const char *path);
+
+#else
+
+#define TRACE(ev, a1, a2)
+
+#endif
+
+#endif